@@ -0,0 +1,14 @@
+#! ./clispy
+; closure creation and calls through captured environments
+(define adder (lambda (a) (lambda (b) (+ a b))))
+(define compose (lambda (f g) (lambda (x) (f (g x)))))
+(define loop (lambda (n acc) 
+  (if (= n 0) acc 
+    (loop (- n 1) ((compose (adder n) (adder 1)) acc)))))
+(display (loop 200000 0))
+(newline)
+(define counter (lambda () (begin (define n 0) (lambda () (begin (set! n (+ n 1)) n)))))
+(define tick (lambda (c k) (if (= k 0) (c) (begin (c) (tick c (- k 1))))))
+(define many (lambda (k acc) (if (= k 0) acc (many (- k 1) (+ acc (tick (counter) 100))))))
+(display (many 3000 0))
+(newline)
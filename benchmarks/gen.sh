@@ -0,0 +1,42 @@
+#! /bin/sh
+# Writes the benchmarks that need a lot of source text, symbols.scm and
+# tokenize.scm, next to this script.  The input is the same on every
+# machine: the numbers come from a fixed Park-Miller generator.
+cd "$(dirname "$0")" || exit 1
+
+awk 'function rnd(n) { x = (x * 16807) % 2147483647; return x % n }
+BEGIN {
+  x = 1
+  print "#! ./clispy"
+  print "; a few thousand global definitions, looked up by name"
+  for (i = 0; i < 3000; i++) printf "(define sym-%d %d)\n", i, i
+  printf "(define lookup (lambda () (+"
+  for (i = 0; i < 50; i++) printf " sym-%d", rnd(3000)
+  print ")))"
+  print "(define loop (lambda (k acc) (if (= k 0) acc (loop (- k 1) (+ acc (lookup))))))"
+  print "(display (loop 200000 0))"
+  print "(newline)"
+  for (i = 0; i < 200; i++) {
+    printf "(define q%d (quote (", i
+    for (j = 0; j < 40; j++) printf "%sword-%d", j ? " " : "", rnd(3000)
+    print ")))"
+  }
+  print "(display (symbol? (car q0)) (length q199))"
+  print "(newline)"
+}' > symbols.scm
+
+awk 'function rnd(n) { x = (x * 16807) % 2147483647; return x % n }
+BEGIN {
+  x = 1
+  split("lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor", w)
+  print "#! ./clispy"
+  print "; large quoted data: strings, numbers, comments and nested lists"
+  for (i = 0; i < 40000; i++) {
+    printf "(define r (quote (record %d \"", i
+    for (j = 0; j < 6; j++) printf "%s%s", j ? " " : "", w[rnd(12) + 1]
+    printf "\" (%.1f \"a \\\"quoted\\\" word\") ; note %d\n", i / 2, i
+    printf "  (tags %s %s) (%d (%d (%d))))))\n", w[rnd(12) + 1], w[rnd(12) + 1], i, i + 1, i + 2
+  }
+  print "(display (length r))"
+  print "(newline)"
+}' > tokenize.scm
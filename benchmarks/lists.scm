@@ -0,0 +1,13 @@
+#! ./clispy
+; building, walking and rebuilding lists
+(define range (lambda (n acc) (if (= n 0) acc (range (- n 1) (cons n acc)))))
+(define rev (lambda (l acc) (if (null? l) acc (rev (cdr l) (cons (car l) acc)))))
+(define sum (lambda (l acc) (if (null? l) acc (sum (cdr l) (+ acc (car l))))))
+(define scale (lambda (l k acc) 
+  (if (null? l) (rev acc (list)) (scale (cdr l) k (cons (* k (car l)) acc)))))
+(define round (lambda (k acc) 
+  (if (= k 0) acc (round (- k 1) (+ acc (sum (scale (range 5000 (list)) k (list)) 0))))))
+(display (round 40 0))
+(newline)
+(display (length (rev (range 100000 (list)) (list))))
+(newline)
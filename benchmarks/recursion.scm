@@ -0,0 +1,9 @@
+#! ./clispy
+; deep and wide non-tail recursion
+(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+(display (fib 27))
+(newline)
+(define depth (lambda (n) (if (= n 0) 0 (+ 1 (depth (- n 1))))))
+(define repeat (lambda (k acc) (if (= k 0) acc (repeat (- k 1) (+ acc (depth 20000))))))
+(display (repeat 60 0))
+(newline)
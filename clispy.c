@@ -6,38 +6,64 @@
  */
 
 #include <stdio.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <time.h>
+#include <dirent.h>
+#include <setjmp.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "clispy.h"
 
 #define CL_VERSION "0.0.1"
+#define CL_BUILD CL_VERSION " " __DATE__ " " __TIME__
 
-typedef union {
-  float f;
-  int i;
-  int address;
-} cl_reg_type;
+/*
+ * A value is one NaN-boxed 64 bit word:
+ *
+ *   0xFFFC... and up   int, 50 bit two's complement in the low bits
+ *   2^49 .. 0xFFFC...  double, with 2^49 added to its bits
+ *   below 2^49         address of a heap variable's header (32 byte 
+ *                      aligned) with its type in the low 5 bits; 
+ *                      0 is nil and 0x20 true
+ *
+ * Doubles only reach into the int range as NaNs with a payload, and 
+ * cl_float turns every NaN into the canonical one.
+ */
 
-typedef union {
-  size_t s;
-  struct {
-    short int type;
-    cl_reg_type d;
-  } t;
-} Id;
+typedef struct { size_t s; } Id;
+
+#define CL_DOUBLE_OFFSET ((size_t)1 << 49)
+#define CL_INT_TAG 0xFFFC000000000000UL
+#define CL_INT_MAX (((long)1 << 49) - 1)
+#define CL_INT_MIN (-((long)1 << 49))
+#define CL_TYPE_MASK 31
+
+#define CL_IS_INT(va) ((va).s >= CL_INT_TAG)
+#define CL_IS_FLOAT(va) ((va).s - CL_DOUBLE_OFFSET < CL_INT_TAG - CL_DOUBLE_OFFSET)
+#define CL_IS_PTR(va) ((va).s < CL_DOUBLE_OFFSET && ((va).s & CL_TYPE_MASK) > 2)
+#define CL_TYPE(va) cl_type(va)
+#define CL_INT(va) ((long)((va).s << 14) >> 14)
+#define CL_FLOAT(va) cl_double(va)
 
-#define CL_ADR(va) va.t.d.address
-#define CL_TYPE(va) va.t.type
-#define CL_INT(va) va.t.d.i
-#define CL_FLOAT(va) va.t.d.f
+static inline int cl_type(Id va) { 
+  return CL_IS_INT(va) ? 2 : va.s >= CL_DOUBLE_OFFSET ? 1 : va.s & CL_TYPE_MASK; }
+static inline double cl_double(Id va) { 
+  union { size_t s; double d; } u = {va.s - CL_DOUBLE_OFFSET}; return u.d; }
 
 static Id clNil = {0}; 
-static Id clTrue = {0};
+static Id clTrue = {0x20};
 
 /*
  * Basic error handling
@@ -48,21 +74,103 @@ typedef struct {
   int error_number;
 } cl_error_t;
 
-cl_error_t cl_error;
-int cl_interactive = 1, cl_verbose = 1;
-FILE *fin;
+/*
+ * Interpreter context
+ *
+ * Everything an interpreter changes lives in its cl_context_t, and cl_ctx
+ * is the context the current thread is running.  Any number of contexts
+ * can exist, each with its own heap, and threads can run different ones
+ * at the same time.  The names below are used for the current context's
+ * fields.
+ */
+
+struct cl_mem_descriptor;
+struct cl_vm_frame;
+
+struct cl_context {
+  void *base;
+  struct cl_mem_descriptor *md;
+  Id symbols, global_env;
+  Id sym_quote, sym_if, sym_set, sym_define, sym_lambda, sym_begin;
+  cl_error_t error;
+  int errors; // reported since the context was opened
+  FILE *fin;
+  int interactive, verbose;
+  char *line; // input buffer
+  size_t line_cap;
+  int shared, lock_depth;
+  int shm; // the heap is a shared memory object (--shared)
+  int proc; // our slot in cl_md->procs, on a shared heap
+  int compact; // see cl_compact_maybe
+  size_t compacted_at;
+  int caching; // allocate from cache, see cl_cache_alloc
+  Id *cache; // free slab slots by size class
+  size_t cache_allocs[CL_TYPE_MASK + 1], cache_bytes[CL_TYPE_MASK + 1];
+  void *gc_stack_bottom;
+  char **gc_stack;
+  size_t gc_stack_size, gc_stack_used;
+  Id *vm_stack;
+  int vm_sp, vm_fp, vm_max_depth;
+  struct cl_vm_frame *vm_frames;
+  char *region; // frames no closure can capture, see cl_region_frame
+  size_t region_top;
+  struct cl_profile *prof; // see cl_prof_start
+};
+
+// initial-exec TLS is a plain load off the thread pointer, but a shared
+// library using it may fail to dlopen, so the library keeps the default
+#ifdef CL_LIBRARY
+__thread cl_context_t *cl_ctx;
+#else
+__thread cl_context_t *cl_ctx __attribute__((tls_model("initial-exec")));
+#endif
+
+#define cl_base (cl_ctx->base)
+#define cl_md (cl_ctx->md)
+#define cl_symbols (cl_ctx->symbols)
+#define cl_global_env (cl_ctx->global_env)
+#define cl_sym_quote (cl_ctx->sym_quote)
+#define cl_sym_if (cl_ctx->sym_if)
+#define cl_sym_set (cl_ctx->sym_set)
+#define cl_sym_define (cl_ctx->sym_define)
+#define cl_sym_lambda (cl_ctx->sym_lambda)
+#define cl_sym_begin (cl_ctx->sym_begin)
+#define cl_error (cl_ctx->error)
+#define fin (cl_ctx->fin)
+#define cl_interactive (cl_ctx->interactive)
+#define cl_verbose (cl_ctx->verbose)
+#define cl_shared (cl_ctx->shared)
+#define cl_lock_depth (cl_ctx->lock_depth)
+#define cl_gc_stack_bottom (cl_ctx->gc_stack_bottom)
+#define cl_gc_stack (cl_ctx->gc_stack)
+#define cl_gc_stack_size (cl_ctx->gc_stack_size)
+#define cl_gc_stack_used (cl_ctx->gc_stack_used)
+#define cl_vm_stack (cl_ctx->vm_stack)
+#define cl_vm_sp (cl_ctx->vm_sp)
+#define cl_vm_fp (cl_ctx->vm_fp)
+#define cl_vm_max_depth (cl_ctx->vm_max_depth)
+#define cl_vm_frames (cl_ctx->vm_frames)
+#define cl_region (cl_ctx->region)
+#define cl_region_top (cl_ctx->region_top)
 
 void cl_reset_errors() { memset(&cl_error, 0, sizeof(cl_error)); }
 int cl_have_error() { return cl_error.error_str[0] != 0x0; }
+#ifdef CL_LIBRARY
+#define CE(w) if (cl_have_error()) { w; }
+#else
 #define CE(w) if (cl_have_error()) { printf("errors\n"); w; }
+#endif
 Id cl_handle_error_with_err_string(const char *ctx, 
     const char *error_msg, char *handle) {
   char h[1024];
   if (handle != 0)  { snprintf(h, 1023, " '%s'", handle); } 
   else { strcpy(h, ""); }
   snprintf((char *)&cl_error.error_str, 1023, "%s%s: %s", ctx, h, error_msg);
+#ifndef CL_LIBRARY // a host reads it with cl_context_error
   printf("error: %s\n", cl_error.error_str);
+#endif
   cl_error.error_number = errno;
+  cl_ctx->errors++;
   return clNil;
 }
 
@@ -81,24 +189,40 @@ Id cl_handle_error_with_err_string_nh(const char *ctx,
  */
 
 #define CL_MEM_SIZE (size_t)(70LL * 1024 * 1024 * 1024)
+// the heap is asked for at the same address in every run, so that a saved
+// image (whose values are addresses) can be mapped back as it is
+#define CL_MEM_BASE ((void *)0x100000000000)
 
 void *cl_shm_create() {
   void *base = 0;
-  base = mmap(0, CL_MEM_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, 
-      -1, (off_t)0);
+  base = mmap(CL_MEM_BASE, CL_MEM_SIZE, PROT_READ | PROT_WRITE, 
+      MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, (off_t)0);
   if (!cl_handle_error(base == MAP_FAILED, "mmap", 0).s) return 0;
   return base;
 }
 
 /* 
  * Memory management
+ *
+ * The heap is a range of 64KB segments.  A run of segments either holds a
+ * single variable (class 0, as large as it needs to be) or is a slab that
+ * is cut into slots of one size class (32 bytes .. 32KB).  Every slot starts
+ * with a cl_cell_header_t and VAs address slots in units of CL_GRANULE bytes.
+ * segs[] in the memory descriptor records, for the first segment of each
+ * run, its length in segments, and for the k-th segment after it, -k.
  */
 
-#define CL_STATIC_ALLOC_SIZE 65535
-// for garbage collection
-#define RCS (sizeof(int)+sizeof(short int))
-#define rc_t int
-#define CL_CELL_SIZE (CL_STATIC_ALLOC_SIZE - RCS)
+#define CL_STATIC_ALLOC_SIZE 65536
+#define CL_GRANULE 32
+#define CL_CLASSES 12
+
+typedef struct {
+  int gc; // 0: free, else CL_GC_LIVE and maybe CL_GC_MARK
+  short int type;
+  short int cls;
+} cl_cell_header_t;
+
+#define RCS (sizeof(cl_cell_header_t))
 
 #ifdef sizeof(size_t) != 8
 #error sizeof(size_t) must be 8 bytes!!
@@ -108,31 +232,61 @@ void *cl_shm_create() {
 #define CL_TYPE_FLOAT 1
 #define CL_TYPE_INT 2
 
-#define cl_string_size_t short int
+#define cl_string_size_t int
 
 typedef struct {
+  size_t allocs, frees, bytes; // bytes: live, including headers and slack
+} cl_type_stats_t;
+
+#define CL_SHARED_PROCS 64
+
+typedef struct { int pid, busy; } cl_shared_proc_t;
+
+typedef struct cl_mem_descriptor {
   int rc_dummy;  
+  char build[32]; // image: build that saved it
+  void *base; // image: address the heap was mapped at
+  Id symbols, global_env; // roots, for images and shared heaps
+  pthread_mutex_t lock; // shared: held by the process changing the heap
+  size_t seq; // shared: odd while the heap is being changed
+  int ready; // shared: set once the creator has filled in the heap
+  int creator; // shared: pid of the process filling it in
+  cl_shared_proc_t procs[CL_SHARED_PROCS]; // shared: attached processes
   Id first_free;
   size_t heap_size;
   size_t total_size;
+  Id bins[CL_CLASSES];
+  size_t bin_free[CL_CLASSES];
+  size_t live_bytes;
+  size_t gc_allocated;
+  size_t gc_threshold;
+  size_t env_version; // see cl_global_cache_t
+  size_t allocs, live_peak, heap_peak, gc_runs, released; // see cl_stats_dump
+  size_t compactions, moved;
+  double gc_ms, gc_max_ms;
+  cl_type_stats_t types[CL_TYPE_MASK + 1];
+  size_t slots[CL_CLASSES]; // carved out of segments
+  int segs[];
 } cl_mem_descriptor_t;
 
 typedef struct {
   int rc_dummy; 
   Id next;
   size_t size;
+  size_t released; // bytes of it given back to the OS
 } cl_mem_chunk_descriptor_t;
 
-size_t cl_header_size() { return CL_STATIC_ALLOC_SIZE; }
-Id cl_header_size_ssa() { Id a; CL_ADR(a) = 1; return a; }
-cl_mem_descriptor_t *cl_md;
-void *cl_base;
-
+#define CL_SEGMENTS (CL_MEM_SIZE / CL_STATIC_ALLOC_SIZE)
+size_t cl_header_size() { 
+  size_t s = sizeof(cl_mem_descriptor_t) + CL_SEGMENTS * sizeof(int);
+  return (s + CL_STATIC_ALLOC_SIZE - 1) / CL_STATIC_ALLOC_SIZE * CL_STATIC_ALLOC_SIZE;
+}
+Id cl_header_size_ssa() { Id a = {(size_t)cl_base + cl_header_size()}; return a; }
 
 #define VA_TO_PTR0(va) \
-  ((va).s ? cl_base + RCS + ((size_t)CL_ADR(va) * CL_STATIC_ALLOC_SIZE) : 0) 
-#define PTR_TO_VA(va, p) \
-  CL_ADR(va) = (int)(((p) - RCS - (char *)cl_base) / CL_STATIC_ALLOC_SIZE);
+  ((va).s ? (void *)(((va).s & ~(size_t)CL_TYPE_MASK) + RCS) : 0) 
+#define PTR_TO_VA(va, p) (va).s = (size_t)((char *)(p) - RCS);
+#define CL_HDR(p) ((cl_cell_header_t *)((char *)(p) - RCS))
 
 #define P_0_R(p, r) if (!(p)) { printf("From %s:%d\n", __FUNCTION__, __LINE__); return (r); }
 #define VA_0_R(va, r) if (!(va).s) { return (r); }
@@ -140,9 +294,7 @@ void *cl_base;
 
 int __ca(Id va, const char *where, int line) {
   char *p0 = VA_TO_PTR0(va); P_0_R(p0, 1); 
-  rc_t *rc = (rc_t *)(p0 - RCS);
-  if ((*rc) == 0) { printf("[%s:%d] error: VA is not allocated!\n", where, line); abort(); }
-  //if ((*rc) == 1) { printf("[%s:%d] Warning: RC is 0\n", where, line); abort(); }
+  if (CL_HDR(p0)->gc == 0) { printf("[%s:%d] error: VA is not allocated!\n", where, line); abort(); }
   return 1;
 }
 
@@ -151,8 +303,30 @@ Id cb(int i) { return i ? clTrue : clNil; }
 
 cl_mem_chunk_descriptor_t *cl_md_first_free() {return VA_TO_PTR0(cl_md->first_free);}
 
-int cl_var_free() {
-    return (cl_md->total_size - cl_md->heap_size) / CL_STATIC_ALLOC_SIZE; }
+size_t cl_class_size(int c) { 
+    return c ? (size_t)CL_GRANULE << (c - 1) : CL_STATIC_ALLOC_SIZE; }
+
+int cl_size_class(size_t size) {
+  int c;
+  for (c = 1; c < CL_CLASSES; c++) if (size <= cl_class_size(c)) return c;
+  return 0;
+}
+
+#define CL_SEG(p) (((char *)(p) - (char *)cl_base) / CL_STATIC_ALLOC_SIZE)
+
+// bytes taken by the slot or segment run starting at header h
+size_t cl_var_size(cl_cell_header_t *h) {
+  return h->cls ? cl_class_size(h->cls) : 
+      (size_t)cl_md->segs[CL_SEG(h)] * CL_STATIC_ALLOC_SIZE; 
+}
+
+size_t cl_capacity(Id va) { 
+    char *p = VA_TO_PTR0(va); P_0_R(p, 0); return cl_var_size(CL_HDR(p)) - RCS; }
+
+size_t cl_var_free(int c) {
+  size_t segments = (cl_md->total_size - cl_md->heap_size) / CL_STATIC_ALLOC_SIZE;
+  return cl_md->bin_free[c] + segments * (CL_STATIC_ALLOC_SIZE / cl_class_size(c)); 
+}
   
 void cl_init_memory(void *ptr) {
   cl_md = ptr;
@@ -164,62 +338,353 @@ void cl_init_memory(void *ptr) {
   cl_mem_chunk_descriptor_t *c = cl_md_first_free();
   c->next.s = 0;
   c->size = s;
+  cl_md->env_version = 1; // code caches start at 0
 }
 
-Id cl_valloc(const char *where, short int type) {
+/*
+ * Shared heap
+ *
+ * With --shared NAME the heap is a named shared memory object that any
+ * number of processes map at CL_MEM_BASE; the first one creates and fills
+ * it, the others wait for it to be ready.  Allocation, freeing and hash
+ * updates take cl_md->lock and keep cl_md->seq odd while they run, so
+ * hash lookups (the global environment) can go without the lock and retry
+ * when a writer got in between.
+ *
+ * No process can see the others' stacks, so a shared heap is only
+ * collected when no process is busy with a form: every process has a 
+ * slot in cl_md->procs, which is busy from the time a form is read into
+ * the heap until the process is done with its value.  Between forms the
+ * symbols and the globals are all the roots there are, and the process
+ * leaving a form collects if nobody else is inside one.
+ */
+
+#ifndef CL_SHM_WAIT_MS
+#define CL_SHM_WAIT_MS 10000 // for the creator to fill in the heap
+#endif
+
+// A robust lock is taken over when its holder dies.  glibc has no macro
+// for PTHREAD_MUTEX_ROBUST (it is an enum), and macOS has no robust
+// mutexes at all; there a crash while holding the lock hangs the others.
+#if defined(__linux__) || defined(PTHREAD_MUTEX_ROBUST)
+#define CL_ROBUST_LOCK
+#endif
+
+int __alive(int pid) { return pid && (kill(pid, 0) == 0 || errno != ESRCH); }
+
+void *cl_shm_open(char *name, int *created) {
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  struct stat st;
+  *created = fd >= 0;
+  if (fd < 0 && errno == EEXIST) fd = shm_open(name, O_RDWR, 0);
+  if (!cl_handle_error(fd < 0, "shm_open", name).s) return 0;
+  if (*created) {
+    if (!cl_handle_error(ftruncate(fd, CL_MEM_SIZE) != 0, "ftruncate", name).s) {
+      close(fd); shm_unlink(name); return 0; }
+  } else {
+    int ms = 0;
+    while (!fstat(fd, &st) && st.st_size != CL_MEM_SIZE && ms++ < CL_SHM_WAIT_MS) 
+        usleep(1000);
+    if (st.st_size != CL_MEM_SIZE) {
+      close(fd);
+      cl_handle_error_with_err_string(name, 
+          "shared heap was never set up; remove it and retry", 0);
+      return 0;
+    }
+  }
+  void *base = mmap(CL_MEM_BASE, CL_MEM_SIZE, PROT_READ | PROT_WRITE, 
+      MAP_SHARED | MAP_NORESERVE, fd, (off_t)0);
+  close(fd);
+  if (!cl_handle_error(base == MAP_FAILED, "mmap", name).s) return 0;
+  if (base != CL_MEM_BASE) {
+    munmap(base, CL_MEM_SIZE);
+    cl_handle_error_with_err_string(name, "address is taken", 0);
+    return 0;
+  }
+  cl_md = base;
+  if (*created) {
+    pthread_mutexattr_t a;
+    pthread_mutexattr_init(&a);
+    pthread_mutexattr_setpshared(&a, PTHREAD_PROCESS_SHARED);
+#ifdef CL_ROBUST_LOCK
+    pthread_mutexattr_setrobust(&a, PTHREAD_MUTEX_ROBUST);
+#endif
+    pthread_mutex_init(&cl_md->lock, &a);
+    cl_md->creator = getpid();
+    return base;
+  }
+  int ms = 0, creator;
+  while (!__atomic_load_n(&cl_md->ready, __ATOMIC_ACQUIRE)) {
+    creator = __atomic_load_n(&cl_md->creator, __ATOMIC_ACQUIRE);
+    if ((creator && !__alive(creator)) || ms++ >= CL_SHM_WAIT_MS) {
+      munmap(base, CL_MEM_SIZE);
+      cl_handle_error_with_err_string(name, 
+          "shared heap was never set up; remove it and retry", 0);
+      return 0;
+    }
+    usleep(1000);
+  }
+  if (strncmp(cl_md->build, CL_BUILD, sizeof(cl_md->build) - 1)) {
+    munmap(base, CL_MEM_SIZE);
+    cl_handle_error_with_err_string(name, "created by another build", 0);
+    return 0;
+  }
+  return base;
+}
+
+static inline void cl_lock() {
+  if (!cl_shared || cl_lock_depth++) return;
+#ifdef CL_ROBUST_LOCK
+  if (pthread_mutex_lock(&cl_md->lock) == EOWNERDEAD) {
+    // the holder died, maybe halfway through a change; carry on regardless
+    pthread_mutex_consistent(&cl_md->lock);
+    if (cl_md->seq & 1) __atomic_add_fetch(&cl_md->seq, 1, __ATOMIC_SEQ_CST);
+  }
+#else
+  pthread_mutex_lock(&cl_md->lock);
+#endif
+  __atomic_add_fetch(&cl_md->seq, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void cl_unlock() {
+  if (!cl_shared || --cl_lock_depth) return;
+  __atomic_add_fetch(&cl_md->seq, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&cl_md->lock);
+}
+
+// a lock-free read starts with cl_read_begin and is redone while 
+// cl_read_retry says that a writer got in between
+size_t cl_read_begin() {
+  size_t s;
+  while ((s = __atomic_load_n(&cl_md->seq, __ATOMIC_ACQUIRE)) & 1) sched_yield();
+  return s;
+}
+
+int cl_read_retry(size_t s) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&cl_md->seq, __ATOMIC_RELAXED) != s;
+}
+
+// first fit of n contiguous segments in the free chunk list
+Id cl_segments_alloc(const char *where, size_t n) {
+  size_t s = n * CL_STATIC_ALLOC_SIZE;
+  Id *prev = &cl_md->first_free;
   cl_mem_chunk_descriptor_t *c = cl_md_first_free(); 
-  if (!c) return cl_handle_error_with_err_string_nh(where, "1: Out of memory");
+  while (c && c->size < s) { prev = &c->next; c = VA_TO_PTR0(c->next); }
+  if (!c) return cl_handle_error_with_err_string_nh(where, "Out of memory");
   Id r = { 0x0 };
-  if (c->size < CL_STATIC_ALLOC_SIZE)
-      return cl_handle_error_with_err_string_nh(where, "2: Out of memory");
-  if (c->size == CL_STATIC_ALLOC_SIZE) {
+  if (c->size == s) {
     // chunk size ==  wanted size
-    cl_md->first_free = c->next; 
+    *prev = c->next; 
     PTR_TO_VA(r, (char *)c);
   } else {
     // chunk is larger than wanted 
-    c->size -= CL_STATIC_ALLOC_SIZE;
+    c->size -= s;
+    if (c->released > c->size - getpagesize()) c->released = c->size - getpagesize();
+    cl_md->segs[CL_SEG(CL_HDR(c))] = c->size / CL_STATIC_ALLOC_SIZE;
     PTR_TO_VA(r, (char *)c + c->size);
   }
-  if (!c->next.s) { cl_md->heap_size += CL_STATIC_ALLOC_SIZE; }
+  if (!c->next.s) { 
+    cl_md->heap_size += s; 
+    if (cl_md->heap_size > cl_md->heap_peak) cl_md->heap_peak = cl_md->heap_size;
+  }
+  size_t i, seg = CL_SEG(r.s);
+  cl_md->segs[seg] = n;
+  for (i = 1; i < n; i++) cl_md->segs[seg + i] = -i;
+  return r;
+}
+
+Id cl_segment_alloc(const char *where) { return cl_segments_alloc(where, 1); }
+
+Id cl_slab_alloc(const char *where, int c) {
+  if (!cl_md->bins[c].s) {
+    Id seg = cl_segment_alloc(where); VA_0_R(seg, clNil);
+    size_t cs = cl_class_size(c), n = CL_STATIC_ALLOC_SIZE / cs;
+    char *p = (char *)VA_TO_PTR0(seg) - RCS + n * cs;
+    cl_md->slots[c] += n;
+    while (n-- > 0) {
+      p -= cs;
+      cl_cell_header_t *h = (cl_cell_header_t *)p;
+      h->gc = 0; h->type = 0; h->cls = c;
+      *(Id *)(p + RCS) = cl_md->bins[c];
+      PTR_TO_VA(cl_md->bins[c], p + RCS);
+      cl_md->bin_free[c]++;
+    }
+  }
+  Id r = cl_md->bins[c];
+  cl_md->bins[c] = *(Id *)VA_TO_PTR0(r);
+  cl_md->bin_free[c]--;
+  return r;
+}
+
+#define CL_GC_LIVE 1
+#define CL_GC_MARK 2
+#ifndef CL_GC_MIN_THRESHOLD
+#define CL_GC_MIN_THRESHOLD (8 * 1024 * 1024)
+#endif
+
+void cl_garbage_collect();
+
+Id __valloc(const char *where, short int type, size_t size) {
+  if (size > CL_MEM_SIZE) 
+      return cl_handle_error_with_err_string_nh(where, "variable too large");
+  if (cl_gc_stack_bottom && !cl_shared && 
+      cl_md->gc_allocated > cl_md->gc_threshold) cl_garbage_collect();
+  int c = cl_size_class(size + RCS);
+  Id r = c ? cl_slab_alloc(where, c) : cl_segments_alloc(where, 
+      (size + RCS + CL_STATIC_ALLOC_SIZE - 1) / CL_STATIC_ALLOC_SIZE);
   if (r.s) { 
-    CL_TYPE(r) = type; 
-    char *p = VA_TO_PTR0(r);
-    rc_t *rc = (rc_t *) (p - RCS);
-    *rc = 0x1;
-    short int *t = (short int *)(p - sizeof(short int));
-    *t = type;
+    r.s = (r.s & ~(size_t)CL_TYPE_MASK) | type; 
+    cl_cell_header_t *h = CL_HDR(VA_TO_PTR0(r));
+    h->gc = CL_GC_LIVE;
+    h->type = type;
+    h->cls = c;
+    cl_md->live_bytes += cl_var_size(h);
+    cl_md->gc_allocated += cl_var_size(h);
+    cl_md->allocs++;
+    cl_md->types[type].allocs++;
+    cl_md->types[type].bytes += cl_var_size(h);
+    if (cl_md->live_bytes > cl_md->live_peak) cl_md->live_peak = cl_md->live_bytes;
   }
   return r; 
 }
 
+// In a parallel section (see pmap) every thread takes slab slots from the
+// heap in batches, so that most of its allocations need no lock.
+#define CL_CACHE_BATCH 32
+
+Id cl_cache_alloc(const char *where, short int type, int c) {
+  Id *b = &cl_ctx->cache[c], r;
+  if (!b->s) {
+    int i;
+    cl_lock();
+    for (i = 0; i < CL_CACHE_BATCH && (r = cl_slab_alloc(where, c)).s; i++) {
+      *(Id *)VA_TO_PTR0(r) = *b; *b = r; }
+    cl_md->live_bytes += i * cl_class_size(c);
+    cl_md->gc_allocated += i * cl_class_size(c);
+    if (cl_md->live_bytes > cl_md->live_peak) cl_md->live_peak = cl_md->live_bytes;
+    cl_unlock();
+    VA_0_R(*b, clNil);
+  }
+  r = *b; 
+  *b = *(Id *)VA_TO_PTR0(r);
+  r.s = (r.s & ~(size_t)CL_TYPE_MASK) | type; 
+  cl_cell_header_t *h = CL_HDR(VA_TO_PTR0(r));
+  h->gc = CL_GC_LIVE;
+  h->type = type;
+  h->cls = c;
+  cl_ctx->cache_allocs[type]++;
+  cl_ctx->cache_bytes[type] += cl_class_size(c);
+  return r;
+}
+
+// gives the unused cached slots back and counts the used ones
+void cl_cache_flush() {
+  int c;
+  cl_lock();
+  for (c = 0; c <= CL_TYPE_MASK; c++) {
+    cl_md->allocs += cl_ctx->cache_allocs[c];
+    cl_md->types[c].allocs += cl_ctx->cache_allocs[c];
+    cl_md->types[c].bytes += cl_ctx->cache_bytes[c];
+    cl_ctx->cache_allocs[c] = cl_ctx->cache_bytes[c] = 0;
+  }
+  for (c = 1; c < CL_CLASSES; c++) {
+    Id *b = &cl_ctx->cache[c];
+    while (b->s) {
+      Id r = *b;
+      *b = *(Id *)VA_TO_PTR0(r);
+      *(Id *)VA_TO_PTR0(r) = cl_md->bins[c];
+      cl_md->bins[c] = r;
+      cl_md->bin_free[c]++;
+      cl_md->live_bytes -= cl_class_size(c);
+    }
+  }
+  cl_unlock();
+}
+
+Id cl_valloc(const char *where, short int type, size_t size) {
+  int c;
+  if (cl_ctx->caching && (c = cl_size_class(size + RCS))) 
+      return cl_cache_alloc(where, type, c);
+  cl_lock(); Id r = __valloc(where, type, size); cl_unlock(); return r; }
+
 int cl_zero(Id va) { 
-    char *p = VA_TO_PTR0(va); P_0_R(p, 0); memset(p, 0, CL_CELL_SIZE); return 0;}
+    char *p = VA_TO_PTR0(va); P_0_R(p, 0); memset(p, 0, cl_capacity(va)); return 0;}
+
+#define CL_ALLOC(va, type, size) \
+  va = cl_valloc(__FUNCTION__, type, size); VA_0_R(va, clNil);
+
+// Free runs of at least cl_release_bytes are handed back to the OS, all
+// but the page that holds their chunk descriptor.  CLISPY_RELEASE_KB
+// sets the threshold; 0 keeps everything.  The collector merges free
+// neighbours into runs, empty slab segments included (see __rebuild).
+#define CL_RELEASE_DEFAULT (1024 * 1024)
+size_t cl_release_bytes = CL_RELEASE_DEFAULT;
+
+// gives back the free run at p, of which done bytes were given back
+// before; returns how much of it is given back now
+size_t __release(char *p, size_t size, size_t done) {
+  size_t pg = getpagesize();
+  if (!cl_release_bytes || size < cl_release_bytes) return done;
+  if (done == size - pg) return done;
+  int advice = MADV_DONTNEED;
+  // dropping the pages of a shared object would only unmap them here
+  if (cl_ctx->shm) {
+#ifdef MADV_REMOVE
+    advice = MADV_REMOVE;
+#else
+    return done; // and nothing else frees them
+#endif
+  }
+  if (madvise(p + pg, size - pg, advice)) return done;
+  cl_md->released += size - pg - done;
+  return size - pg;
+}
 
-#define CL_ALLOC(va, type) va = cl_valloc(__FUNCTION__, type); VA_0_R(va, clNil);
+// bookkeeping for a variable that is no longer used
+void __dead(cl_cell_header_t *h) {
+  h->gc = 0;
+  cl_md->live_bytes -= cl_var_size(h);
+  cl_md->types[h->type].frees++;
+  cl_md->types[h->type].bytes -= cl_var_size(h);
+}
 
-int cl_free(Id va) {
-  int t = CL_TYPE(va);
-  if (t == CL_TYPE_BOOL || t == CL_TYPE_FLOAT || t == CL_TYPE_INT) return 0;
+int __free(Id va) {
+  if (!CL_IS_PTR(va)) return 0;
   char *used_chunk_p = VA_TO_PTR(va); P_0_R(used_chunk_p, 0);
+  cl_cell_header_t *h = CL_HDR(used_chunk_p);
+  __dead(h);
+  if (h->cls) {
+    *(Id *)used_chunk_p = cl_md->bins[h->cls];
+    cl_md->bins[h->cls] = va;
+    cl_md->bin_free[h->cls]++;
+    return 1;
+  }
   cl_mem_chunk_descriptor_t *mcd_used_chunk = 
       (cl_mem_chunk_descriptor_t *)used_chunk_p;
   mcd_used_chunk->next = cl_md->first_free;
-  mcd_used_chunk->size = CL_STATIC_ALLOC_SIZE;
+  mcd_used_chunk->size = cl_var_size(h);
   mcd_used_chunk->rc_dummy = 0;
   cl_md->first_free = va;
+  mcd_used_chunk->released = __release((char *)h, mcd_used_chunk->size, 0);
   return 1;
 }
 
+int cl_free(Id va) { cl_lock(); int r = __free(va); cl_unlock(); return r; }
+
 /*
  * Register types.
  */
 
-Id cl_int(int i) { 
-    Id va; CL_TYPE(va) = CL_TYPE_INT; CL_INT(va) = i; return va; }
+Id cl_float(double f) { 
+  union { double d; size_t s; } u = {f}; 
+  if (f != f) u.s = 0x7FF8000000000000UL;
+  Id va = {u.s + CL_DOUBLE_OFFSET}; return va; }
 
-Id cl_float(float f) { 
-    Id va; CL_TYPE(va) = CL_TYPE_FLOAT; CL_FLOAT(va) = f; return va; }
+// ints that do not fit in 50 bits become doubles
+Id cl_int(long i) { 
+  if (i < CL_INT_MIN || i > CL_INT_MAX) return cl_float(i);
+  Id va = {CL_INT_TAG | ((size_t)i & ~CL_INT_TAG)}; return va; }
 
 Id cn(Id v) { return CL_TYPE(v) == CL_TYPE_BOOL ? cl_int(v.s ? 1 : 0) : v; }
 
@@ -231,13 +696,17 @@ Id cn(Id v) { return CL_TYPE(v) == CL_TYPE_BOOL ? cl_int(v.s ? 1 : 0) : v; }
 #define CL_TYPE_SYMBOL 4
 #define CL_TYPE_CFUNC 5
 #define CL_TYPE_HASH 6
-#define CL_TYPE_HASH_PAIR 7
+#define CL_TYPE_HASH_DATA 7
 #define CL_TYPE_ARRAY 8
-#define CL_TYPE_MAX 8
+#define CL_TYPE_ARRAY_DATA 9
+#define CL_TYPE_CODE 10
+#define CL_TYPE_LAMBDA 11
+#define CL_TYPE_FRAME 12
+#define CL_TYPE_MAX 12
 
 char *cl_types_s[] = {"nil", "float", "int", "string", "symbol", "cfunc", "hash", 
-    "hash pair", "array"};
-char *cl_types_i[] = {"", "", "", "'", ":", "", "%", "", ""};
+    "hash data", "array", "array data", "code", "lambda", "frame"};
+char *cl_types_i[] = {"", "", "", "'", ":", "", "%", "", "", "", "", "", ""};
 
 char *cl_type_to_cp(short int t) {
   if (t > CL_TYPE_MAX || t < 0) { return "<unknown>"; }
@@ -252,7 +721,7 @@ char *cl_type_to_i_cp(short int t) {
 int cl_is_string(Id va) { 
     return CL_TYPE(va) == CL_TYPE_SYMBOL || CL_TYPE(va) == CL_TYPE_STRING; }
 int cl_is_number(Id va) { 
-    return CL_TYPE(va) == CL_TYPE_FLOAT || CL_TYPE(va) == CL_TYPE_INT; }
+    return va.s >= CL_DOUBLE_OFFSET; }
 int c_type(int t) { return t == CL_TYPE_SYMBOL ? CL_TYPE_STRING : t;}
 int cl_is_type_i(Id va, int t) { return c_type(CL_TYPE(va)) == c_type(t); }
 #define S cl_string_new_c
@@ -275,64 +744,12 @@ int cl_is_type_i(Id va, int t) { return c_type(CL_TYPE(va)) == c_type(t); }
 #define CL_TYPED_VA_TO_PTR(p,v,t,r) __CL_TYPED_VA_TO_PTR(p,v,t,r,VA_TO_PTR)
 #define CL_TYPED_VA_TO_PTR0(p,v,t,r) __CL_TYPED_VA_TO_PTR(p,v,t,r,VA_TO_PTR0)
 
-/*
- * Reference counting.
- */
-
-#define RCI if (!va.s || va.t.type < 3) { return va; }; char *p0 = VA_TO_PTR0(va); \
-  P_0_R(p0, clNil); rc_t *rc = (rc_t *)(p0 - RCS);
-
-int cl_ary_free(Id);
-int cl_ht_free(Id);
-
-Id cl_release(Id va) { 
-  RCI; CL_CHECK_ERROR((*rc <= 1), "Reference counter is already 0!", clNil);
-  --(*rc);
-  return va;
-}
-
-Id cl_delete(Id va) { 
-  RCI; 
-  if ((*rc) == 0x0) return clNil; // ignore, so one can jump at random address!
-  CL_CHECK_ERROR((*rc != 1), "Cannot delete, rc != 0!", clNil);
-  switch (CL_TYPE(va)) {
-    case CL_TYPE_ARRAY: cl_ary_free(va); break;
-    case CL_TYPE_HASH: cl_ht_free(va); break;
-    case CL_TYPE_HASH_PAIR: /* ignore: will always be freed by hash */; break;
-    default: cl_free(va); break;
-  }
-  (*rc) = 0x0;
-  return clTrue;
-}
-
-void cl_garbage_collect() {
-  size_t entries = cl_md->heap_size / CL_STATIC_ALLOC_SIZE;
-  size_t mem_start = cl_md->total_size + cl_header_size() - cl_md->heap_size;
-  char *p = mem_start + cl_base;
-  size_t i;
-  for (i = 0; i < entries; ++i, p += CL_STATIC_ALLOC_SIZE) {
-    rc_t *rc = (rc_t *)p;
-    short int *t = (short int *) (p + sizeof(int));
-    if (*rc == 1) {
-      Id va;
-      PTR_TO_VA(va, p + RCS);
-      CL_TYPE(va) = *t;
-      cl_delete(va);
-    }
-  }
-}
-
-Id cl_retain(Id va) { RCI; (*rc)++; return va; }
-
 /*
  * String
  */
 
-#define CL_STR_MAX_LEN (CL_CELL_SIZE - sizeof(cl_string_size_t))
-
 int cl_strdup(Id va_dest, char *source, cl_string_size_t l) {
   char *p; CL_TYPED_VA_TO_PTR0(p, va_dest, CL_TYPE_STRING, 0);
-  CL_CHECK_ERROR((l + 1 > CL_STR_MAX_LEN), "strdup: string too large", 0);
   *(cl_string_size_t *) p = l;
   p += sizeof(cl_string_size_t);
   memcpy(p, source, l);
@@ -342,8 +759,8 @@ int cl_strdup(Id va_dest, char *source, cl_string_size_t l) {
 }
 
 Id cl_string_new(char *source, cl_string_size_t l) { 
-  Id va; CL_ALLOC(va, CL_TYPE_STRING);
-  if (l > 0 && !cl_strdup(va, source, l)) return clNil;
+  Id va; CL_ALLOC(va, CL_TYPE_STRING, sizeof(cl_string_size_t) + l + 1);
+  if (!cl_strdup(va, source, l)) return clNil;
   return va;
 }
 
@@ -352,45 +769,66 @@ Id cl_string_new_c(char *source) {
 #define S cl_string_new_c
 
 Id cl_string_new_number(Id n) { 
-  Id va; CL_ALLOC(va, CL_TYPE_STRING);
   int i = CL_TYPE(n) == CL_TYPE_INT;
   char ns[1024]; 
-  i ? snprintf(ns, 1023, "%d", CL_INT(n)) : snprintf(ns, 1023, "%f", CL_FLOAT(n));
+  i ? snprintf(ns, 1023, "%ld", CL_INT(n)) : snprintf(ns, 1023, "%f", CL_FLOAT(n));
   return S(ns);
 }
 
-Id cl_string_new_0() { return cl_string_new("", 0); }
-
 typedef struct { char *s; cl_string_size_t l; } cl_str_d;
 
+// a symbol is its name, as a string, behind the precomputed hash
+typedef struct {
+  size_t hash;
+  cl_string_size_t l;
+  char s[];
+} cl_symbol_t;
+
 int cl_acquire_string_data(Id va_s, cl_str_d *d) { 
   char *s; CL_TYPED_VA_TO_PTR(s, va_s, CL_TYPE_STRING, 0);
+  if (CL_TYPE(va_s) == CL_TYPE_SYMBOL) s += offsetof(cl_symbol_t, l);
   d->s = s + sizeof(cl_string_size_t); d->l = *(cl_string_size_t *) s; 
   return 1;
 }
 
-int sr = 0;
+__thread int sr;
 #define CL_ACQUIRE_STR_D(n,va,r) \
   cl_str_d n; sr = cl_acquire_string_data(va, &n); P_0_R(sr, r);
 char *cl_string_ptr(Id va_s) { CL_ACQUIRE_STR_D(ds, va_s, 0x0); return ds.s; }
 
-Id cl_string_append(Id va_d, Id va_s) {
-  CL_ACQUIRE_STR_D(dd, va_d, clNil); CL_ACQUIRE_STR_D(ds, va_s, clNil);
-  size_t l = dd.l + ds.l;
-  CL_CHECK_ERROR((l + 1 > CL_STR_MAX_LEN), "append: string too large", clNil);
-  memcpy(dd.s + dd.l, ds.s, ds.l);
+// returns va_d, or a larger copy of it if va_d's slot is too small; the
+// copy at least doubles the slot, so repeated appends are amortized O(1)
+Id cl_string_append_n(Id va_d, char *s, size_t sl) {
+  CL_ACQUIRE_STR_D(dd, va_d, clNil);
+  size_t l = dd.l + sl;
+  CL_CHECK_ERROR((l >= INT_MAX), "append: string too large", clNil);
+  if (CL_TYPE(va_d) == CL_TYPE_SYMBOL || 
+      sizeof(cl_string_size_t) + l + 1 > cl_capacity(va_d)) {
+    size_t n = sizeof(cl_string_size_t) + l + 1, c = cl_capacity(va_d);
+    if (CL_TYPE(va_d) == CL_TYPE_STRING && n < 2 * c) n = 2 * c;
+    Id va_n; CL_ALLOC(va_n, CL_TYPE_STRING, n);
+    cl_strdup(va_n, dd.s, dd.l);
+    va_d = va_n; sr = cl_acquire_string_data(va_d, &dd); P_0_R(sr, clNil);
+  }
+  memcpy(dd.s + dd.l, s, sl);
   *(cl_string_size_t *) (dd.s - sizeof(cl_string_size_t)) = l;
   dd.s += l;
   (*dd.s) = 0x0;
   return va_d;
 }
 
+Id cl_string_append(Id va_d, Id va_s) {
+  CL_ACQUIRE_STR_D(ds, va_s, clNil); return cl_string_append_n(va_d, ds.s, ds.l); }
+
+size_t cl_hash_bytes(char *s, size_t l) {
+  size_t v, i;
+  for (v = 0, i = 0; i++ < l; s++) { v = *s + 31 * v; }
+  return v;
+}
+
 int cl_string_hash(Id va_s, size_t *hash) {
-  CL_ACQUIRE_STR_D(ds, va_s, 0); char *s = ds.s;
-  size_t v;
-  cl_string_size_t i;
-  for (v = 0, i = 0; i++ < ds.l; s++) { v = *s + 31 * v; }
-  (*hash) = v;
+  CL_ACQUIRE_STR_D(ds, va_s, 0); 
+  (*hash) = cl_hash_bytes(ds.s, ds.l);
   return 1;
 }
 
@@ -403,14 +841,11 @@ int cl_string_equals_cp_i(Id va_s, char *b) {
   return 1;
 }
 
-void __cp(char **d, char **s, size_t l, int is) {
-    memcpy(*d, *s, l); (*d) += l; if (is) (*s) += l; }
-
 Id cl_string_replace(Id va_s, Id va_a, Id va_b) {
   CL_ACQUIRE_STR_D(ds, va_s, clNil); CL_ACQUIRE_STR_D(da, va_a, clNil); 
   CL_ACQUIRE_STR_D(db, va_b, clNil); 
-  Id va_new = cl_string_new_0(); CL_ACQUIRE_STR_D(dn, va_new, clNil);
-  char *dp = dn.s, *sp = ds.s; P_0_R(dp, clNil)
+  Id va_r = cl_string_new("", 0); VA_0_R(va_r, clNil);
+  char *sp = ds.s;
   size_t i, match_pos = 0;
   for (i = 0; i < ds.l; i++) {
     if (ds.s[i] != da.s[match_pos]) {
@@ -419,17 +854,15 @@ Id cl_string_replace(Id va_s, Id va_a, Id va_b) {
     }
     if (match_pos == da.l - 1) {
       size_t l = i - (sp - ds.s) - match_pos;
-      __cp(&dp, &sp, l, 1);
-      sp += da.l;
-      __cp(&dp, &db.s, db.l, 0);
+      va_r = cl_string_append_n(va_r, sp, l); VA_0_R(va_r, clNil);
+      sp += l + da.l;
+      va_r = cl_string_append_n(va_r, db.s, db.l); VA_0_R(va_r, clNil);
       match_pos = 0;
       continue;
     }
     match_pos++;
   }
-  __cp(&dp, &sp, (size_t)ds.l - (sp - ds.s), 0);
-  *(cl_string_size_t *)(dn.s - sizeof(cl_string_size_t)) = dp - dn.s;
-  return va_new;
+  return cl_string_append_n(va_r, sp, (size_t)ds.l - (sp - ds.s));
 }
 
 /*
@@ -437,6 +870,7 @@ Id cl_string_replace(Id va_s, Id va_a, Id va_b) {
  */
 
 size_t cl_hash_var(Id va) {
+  if (CL_TYPE(va) == CL_TYPE_SYMBOL) return ((cl_symbol_t *)VA_TO_PTR0(va))->hash;
   if (CL_TYPE(va) == CL_TYPE_STRING) {
     size_t h;
     cl_string_hash(va, &h);
@@ -449,7 +883,8 @@ Id cnil2(Id i) {
     return CL_TYPE(i) == CL_TYPE_ARRAY && cl_ary_len(i) == 0 ? clNil : i; }
 
 int cl_equals_i(Id a, Id b) {
-  if (cl_is_string(a) && cl_is_string(b)) {
+  if (CL_TYPE(a) == CL_TYPE_SYMBOL || CL_TYPE(b) == CL_TYPE_SYMBOL) return a.s == b.s;
+  if (CL_TYPE(a) == CL_TYPE_STRING && CL_TYPE(b) == CL_TYPE_STRING) {
      CL_ACQUIRE_STR_D(da, a, 0); CL_ACQUIRE_STR_D(db, b, 0); 
      if (da.l != db.l) return 0;
      cl_string_size_t i;
@@ -465,241 +900,414 @@ int cl_equals_i(Id a, Id b) {
  * Hashtable
  */
 
+// contents of a CL_TYPE_ARRAY_DATA variable, see Array
+typedef struct {
+  int lo, hi;
+  Id e[];
+} cl_ary_data_t;
+
+/*
+ * Open addressing with Robin Hood probing: an entry never sits further
+ * from its home slot than the entry it displaced, which keeps probe
+ * sequences short, and deletion shifts the following run back instead
+ * of leaving tombstones.  Entries are stored inline together with their
+ * hash, so most mismatches are rejected without looking at the key.
+ */
+
 typedef struct {
   Id va_key;
   Id va_value;
-  Id va_next;
+  size_t hash; // 0: slot is empty
 } cl_ht_entry_t;
-#define CL_HT_BUCKETS ((CL_CELL_SIZE - (2 * sizeof(Id))) / sizeof(Id))
 typedef struct {
   int size;
-  Id va_buckets[CL_HT_BUCKETS];
-  Id va_parent;
+  int cap; // power of 2
+  Id va_entries;
 } cl_hash_t;
+#define CL_HT_MIN_CAP 8
+#define CL_HT_MAX_CAP (1 << 30)
+#define CL_HT_USED ((size_t)1 << 63)
+
+size_t __ht_mix(size_t h) {
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL; 
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL; 
+  h ^= h >> 33;
+  return h | CL_HT_USED;
+}
+
+size_t cl_ht_hash(Id va_key) { return __ht_mix(cl_hash_var(va_key)); }
+
+cl_ht_entry_t *__ht_slot(cl_hash_t *ht, size_t i) { 
+    return (cl_ht_entry_t *)VA_TO_PTR0(ht->va_entries) + i; }
 
-Id cl_ht_new() {
-    Id va_ht; CL_ALLOC(va_ht, CL_TYPE_HASH); cl_zero(va_ht); return va_ht; }
+#define CL_HT_DIST(ht, h, i) (((i) - (h)) & ((ht)->cap - 1))
+
+// e is not in the table yet, and there is room for it
+void __ht_insert(cl_hash_t *ht, cl_ht_entry_t e) {
+  cl_ht_entry_t *s, t;
+  size_t m = ht->cap - 1, i = e.hash & m, d = 0;
+  ht->size++;
+  for (;; i = (i + 1) & m, d++) {
+    s = __ht_slot(ht, i);
+    if (!s->hash) { *s = e; return; }
+    size_t sd = CL_HT_DIST(ht, s->hash, i);
+    if (sd < d) { t = *s; *s = e; e = t; d = sd; }
+  }
+}
 
-size_t cl_ht_hash(Id va_s) {
-    return cl_hash_var(va_s) % CL_HT_BUCKETS; }
+Id __ht_alloc(int cap) {
+  Id va_e = cl_valloc(__FUNCTION__, CL_TYPE_HASH_DATA, cap * sizeof(cl_ht_entry_t));
+  VA_0_R(va_e, clNil); cl_zero(va_e);
+  return va_e;
+}
 
-int cl_ht_hash_destroy(Id ht) { 
+int __ht_resize(cl_hash_t *ht, int cap) {
+  Id va_e = __ht_alloc(cap); VA_0_R(va_e, 0);
+  cl_hash_t old = *ht;
+  int i;
+  ht->va_entries = va_e;
+  ht->cap = cap;
+  ht->size = 0;
+  for (i = 0; i < old.cap; i++) {
+    cl_ht_entry_t *s = __ht_slot(&old, i);
+    if (s->hash) __ht_insert(ht, *s);
+  }
+  if (old.va_entries.s) cl_free(old.va_entries);
   return 1;
 }
 
-cl_ht_entry_t cl_ht_null_node = { 0, 0, 0 };
+Id cl_ht_new_sized(int n) {
+  Id va_ht; CL_ALLOC(va_ht, CL_TYPE_HASH, sizeof(cl_hash_t)); 
+  cl_zero(va_ht); 
+  cl_hash_t *ht = VA_TO_PTR0(va_ht);
+  int cap = CL_HT_MIN_CAP;
+  while (cap < CL_HT_MAX_CAP && cap * 3 < n * 4) cap *= 2;
+  if (!__ht_resize(ht, cap)) return clNil;
+  return va_ht; 
+}
 
-#define CL_HT_ITER_BEGIN(r) \
-  Id va_hr; cl_ht_entry_t *hr = &cl_ht_null_node; \
-  cl_hash_t *ht; CL_TYPED_VA_TO_PTR(ht, va_ht, CL_TYPE_HASH, (r)); \
-  size_t k = cl_ht_hash(va_key); \
-  for (va_hr = ht->va_buckets[k];  \
-      va_hr.s != 0 && hr != NULL; ) { \
-    CL_TYPED_VA_TO_PTR(hr, va_hr, CL_TYPE_HASH_PAIR, (r)); \
-    if (!hr || !cl_equals_i(va_key, hr->va_key)) goto next; 
+Id cl_ht_new() { return cl_ht_new_sized(0); }
 
-#define CL_HT_ITER_END(v) } return (v);
+// slot index of va_key, or -1
+long __ht_find(cl_hash_t *ht, Id va_key) {
+  size_t h = cl_ht_hash(va_key), m = ht->cap - 1, i = h & m, d = 0;
+  for (;; i = (i + 1) & m, d++) {
+    cl_ht_entry_t *s = __ht_slot(ht, i);
+    if (!s->hash || CL_HT_DIST(ht, s->hash, i) < d) return -1;
+    if (s->hash == h && cl_equals_i(va_key, s->va_key)) return i;
+  }
+}
 
 int cl_ht_lookup(cl_ht_entry_t **_hr, Id va_ht, Id va_key) {
-  (*_hr) = &cl_ht_null_node; 
-  CL_HT_ITER_BEGIN(0) 
-    (*_hr) = hr;
-    return 1;
-    next: va_hr = hr->va_next;
-  CL_HT_ITER_END(0);
+  *_hr = 0;
+  cl_hash_t *ht; CL_TYPED_VA_TO_PTR(ht, va_ht, CL_TYPE_HASH, 0);
+  long i = __ht_find(ht, va_key);
+  if (i < 0) return 0;
+  *_hr = __ht_slot(ht, i);
+  return 1;
 }
 
-Id cl_ht_delete(Id va_ht, Id va_key) {
-  Id va_p = clNil;
-  CL_HT_ITER_BEGIN(clNil);
-    cl_ht_entry_t *p = VA_TO_PTR(va_p);
-    if (p) { p->va_next = hr->va_next; }
-    else { ht->va_buckets[k] = clNil; }
-    cl_release(hr->va_value); cl_release(hr->va_key); cl_free(va_hr);
-    ht->size -= 1;
-    return clTrue; 
-  next: va_p = va_hr;
-  CL_HT_ITER_END(clTrue);
-}
-
-int cl_ht_free(Id va_ht) {
-  int k; Id va_hr, va_p = clNil; cl_ht_entry_t *hr = &cl_ht_null_node; 
-  cl_hash_t *ht; CL_TYPED_VA_TO_PTR(ht, va_ht, CL_TYPE_HASH, 0); 
-  for (k = 0; k < CL_HT_BUCKETS; k++) {
-    for (va_hr = ht->va_buckets[k]; va_hr.s != 0 && hr != NULL; va_hr = hr->va_next) {
-      CL_TYPED_VA_TO_PTR(hr, va_hr, CL_TYPE_HASH_PAIR, 0); 
-      cl_release(hr->va_value); cl_release(hr->va_key); 
-      if (va_p.s) cl_free(va_p);
-      va_p = va_hr;
-    }
-  }
-  if (va_p.s) cl_free(va_p);
-  cl_free(va_ht);
-  return 1;
+Id __ht_delete(Id va_ht, Id va_key) {
+  cl_hash_t *ht; CL_TYPED_VA_TO_PTR(ht, va_ht, CL_TYPE_HASH, clNil);
+  long i = __ht_find(ht, va_key);
+  if (i < 0) return clTrue;
+  if (va_ht.s == cl_global_env.s) cl_md->env_version++;
+  size_t m = ht->cap - 1, n = (i + 1) & m;
+  cl_ht_entry_t *s = __ht_slot(ht, i), *sn;
+  while ((sn = __ht_slot(ht, n))->hash && CL_HT_DIST(ht, sn->hash, n) > 0) {
+    *s = *sn; s = sn; n = (n + 1) & m; }
+  memset(s, 0, sizeof(cl_ht_entry_t));
+  ht->size--;
+  if (ht->cap > CL_HT_MIN_CAP && ht->size * 8 < ht->cap) 
+      __ht_resize(ht, ht->cap / 2);
+  return clTrue;
 }
 
+Id cl_ht_delete(Id va_ht, Id va_key) {
+  cl_lock(); Id r = __ht_delete(va_ht, va_key); cl_unlock(); return r; }
+
 Id cl_ht_get(Id va_ht, Id va_key) { 
-  cl_ht_entry_t *hr; cl_ht_lookup(&hr, va_ht, va_key);  P_0_R(hr, clNil);
-  return hr->va_value;
+  cl_ht_entry_t *hr; 
+  if (!cl_shared || cl_lock_depth) 
+      return cl_ht_lookup(&hr, va_ht, va_key) ? hr->va_value : clNil;
+  size_t seq;
+  Id r;
+  do {
+    seq = cl_read_begin();
+    r = cl_ht_lookup(&hr, va_ht, va_key) ? hr->va_value : clNil;
+  } while (cl_read_retry(seq));
+  return r;
 }
 
-Id cl_ht_set(Id va_ht, Id va_key, Id va_value) {
+Id __ht_set(Id va_ht, Id va_key, Id va_value) {
   cl_hash_t *ht; CL_TYPED_VA_TO_PTR(ht, va_ht, CL_TYPE_HASH, clNil);
-  cl_ht_entry_t *hr; cl_ht_lookup(&hr, va_ht, va_key);
-  size_t v;
-  int new_entry = !hr->va_value.s;
-  Id va_hr;
-  if (new_entry) { 
-    v = cl_ht_hash(va_key);
-    CL_ALLOC(va_hr, CL_TYPE_HASH_PAIR);
-    cl_retain(va_hr); hr = VA_TO_PTR(va_hr); P_0_R(hr, clNil);
-    hr->va_key = cl_retain(va_key);
-    ht->size += 1;
-  } 
-
-  hr->va_value = cl_retain(va_value);
-  if (new_entry) {
-    hr->va_next = ht->va_buckets[v];
-    ht->va_buckets[v] = va_hr;
+  cl_ht_entry_t *hr;
+  if (cl_ht_lookup(&hr, va_ht, va_key)) { hr->va_value = va_value; return va_value; }
+  if (va_ht.s == cl_global_env.s) cl_md->env_version++;
+  if ((ht->size + 1) * 4 > ht->cap * 3) {
+    if (ht->cap < CL_HT_MAX_CAP) { if (!__ht_resize(ht, ht->cap * 2)) return clNil; }
+    else CL_CHECK_ERROR(ht->size == ht->cap, "hash is full", clNil);
   }
+  cl_ht_entry_t e = {va_key, va_value, cl_ht_hash(va_key)};
+  __ht_insert(ht, e);
   return va_value;
 }
 
-Id cl_symbols;
+Id cl_ht_set(Id va_ht, Id va_key, Id va_value) {
+  cl_lock(); Id r = __ht_set(va_ht, va_key, va_value); cl_unlock(); return r; }
+
+// Symbols are unique: equal names give the same Id, so they compare and
+// hash by Id.  cl_symbols maps each symbol to itself.
+Id __intern_n(char *s, size_t l) { 
+  size_t hv = cl_hash_bytes(s, l), h = __ht_mix(hv);
+  cl_hash_t *ht = VA_TO_PTR0(cl_symbols);
+  size_t m = ht->cap - 1, i = h & m, d = 0;
+  for (;; i = (i + 1) & m, d++) {
+    cl_ht_entry_t *e = __ht_slot(ht, i);
+    if (!e->hash || CL_HT_DIST(ht, e->hash, i) < d) break;
+    if (e->hash != h) continue;
+    cl_symbol_t *sym = VA_TO_PTR0(e->va_key);
+    if (sym->l == l && !memcmp(sym->s, s, l)) return e->va_key;
+  }
+  Id va; CL_ALLOC(va, CL_TYPE_SYMBOL, sizeof(cl_symbol_t) + l + 1);
+  cl_symbol_t *sym = VA_TO_PTR0(va);
+  sym->hash = hv; sym->l = l;
+  memcpy(sym->s, s, l); sym->s[l] = 0;
+  return cl_ht_set(cl_symbols, va, va);
+}
+
+Id cl_intern_n(char *s, size_t l) { 
+  cl_lock(); Id r = __intern_n(s, l); cl_unlock(); return r; }
 
 Id cl_intern(Id va_s) { 
-  if (CL_TYPE(va_s) == CL_TYPE_SYMBOL) CL_TYPE(va_s) = CL_TYPE_STRING;
-  Id va = cl_ht_get(cl_symbols, va_s); 
-  if (va.s) { return va; }
-  Id va_sym = va_s; CL_TYPE(va_sym) = CL_TYPE_SYMBOL;
-  if (cnil(cl_ht_set(cl_symbols, va_s, va_sym))) return clNil;
-  return cl_ht_get(cl_symbols, va_s); 
-}
-
-Id cl_env_new(Id va_ht_parent) {
-  Id va = cl_ht_new();
-  cl_hash_t *ht; CL_TYPED_VA_TO_PTR(ht, va, CL_TYPE_HASH, clNil);
-  ht->va_parent = va_ht_parent;
-  return va;
+  if (CL_TYPE(va_s) == CL_TYPE_SYMBOL) return va_s;
+  CL_ACQUIRE_STR_D(ds, va_s, clNil);
+  return cl_intern_n(ds.s, ds.l);
 }
+#define CP_INTERN(s) cl_intern_n((s), strlen(s))
 
-#define CL_ENV_FIND \
-  Id va0 = va_ht, found = clNil; \
-  while (va_ht.s && !(found = cl_ht_get(va_ht, va_key)).s) { \
-    cl_hash_t *ht; CL_TYPED_VA_TO_PTR(ht, va_ht, CL_TYPE_HASH, clNil); \
-    va_ht = ht->va_parent; \
-  }
+void cl_add_globals(Id env);
+void cl_intern_forms();
+int cl_image_load(char *path);
+
+#define CL_HUGE_PAGE (2 * 1024 * 1024)
+
+// CLISPY_HUGEPAGES_MB asks for transparent huge pages for that much of
+// the heap's top end, where it starts and is densest (Linux only).
+void cl_heap_advise() {
+  char *e = getenv("CLISPY_RELEASE_KB");
+  if (e) cl_release_bytes = (size_t)atol(e) * 1024;
+#ifdef MADV_HUGEPAGE
+  if (!(e = getenv("CLISPY_HUGEPAGES_MB"))) return;
+  size_t end = cl_md->total_size + cl_header_size(), n = (size_t)atol(e) << 20;
+  if (n > cl_md->total_size) n = cl_md->total_size;
+  n &= ~(size_t)(CL_HUGE_PAGE - 1);
+  if (n && madvise((char *)cl_base + end - n, n, MADV_HUGEPAGE)) 
+      perror("CLISPY_HUGEPAGES_MB");
+#endif
+}
 
-Id cl_env_find(Id va_ht, Id va_key) { 
-  CL_ENV_FIND; 
-  return found; 
+// takes a slot in cl_md->procs; slots of processes that are gone are reused
+int cl_shared_join() {
+  int i;
+  cl_ctx->proc = -1;
+  cl_lock();
+  for (i = 0; i < CL_SHARED_PROCS && __alive(cl_md->procs[i].pid); i++);
+  if (i < CL_SHARED_PROCS) {
+    cl_md->procs[i].pid = getpid(); cl_md->procs[i].busy = 0; cl_ctx->proc = i; }
+  cl_unlock();
+  CL_CHECK_ERROR((i == CL_SHARED_PROCS), "too many processes on the heap", 0);
+  return 1;
 }
 
-Id cl_env_find_and_set(Id va_ht, Id va_key, Id va_value) { 
-  CL_ENV_FIND;
-  if (found.s) { return cl_ht_set(va_ht, va_key, va_value); }
-  else { return cl_ht_set(va0, va_key, va_value); }
+void cl_shared_quit() {
+  if (!cl_ctx->shm || cl_ctx->proc < 0) return;
+  cl_lock(); cl_md->procs[cl_ctx->proc].pid = 0; cl_unlock();
 }
 
-Id cl_global_env;
+// the form being read, and its value, are in the heap from now on
+void cl_shared_enter() {
+  if (!cl_ctx->shm) return;
+  cl_lock(); cl_md->procs[cl_ctx->proc].busy = 1; cl_unlock();
+}
 
-void cl_add_globals(Id env);
+// done with the form; collects if no process is in one
+void cl_shared_leave() {
+  if (!cl_ctx->shm) return;
+  int i;
+  cl_lock(); 
+  cl_md->procs[cl_ctx->proc].busy = 0;
+  for (i = 0; i < CL_SHARED_PROCS; i++) {
+    cl_shared_proc_t *p = &cl_md->procs[i];
+    if (p->busy && !__alive(p->pid)) p->busy = p->pid = 0; // died inside one
+    if (p->busy) break;
+  }
+  if (i == CL_SHARED_PROCS && cl_gc_stack_bottom && 
+      cl_md->gc_allocated > cl_md->gc_threshold) cl_garbage_collect();
+  cl_unlock();
+}
 
-void cl_init() {
-  clTrue.t.d.i = 1;
-  cl_base = cl_shm_create();
-  cl_init_memory(cl_base);
-  cl_symbols = cl_retain(cl_ht_new());
-  cl_global_env = cl_retain(cl_ht_new());
-  cl_add_globals(cl_global_env);
-  if (cl_interactive) 
-      printf("clispy %s started; %d vars available\n", CL_VERSION, cl_var_free());
+int cl_init(char *image, char *shared) {
+  int fresh = 1;
+  if (image) {
+    if (!cl_image_load(image)) return 0;
+    fresh = 0;
+  } else if (shared) {
+    if (!(cl_base = cl_shm_open(shared, &fresh))) return 0;
+    cl_shared = cl_ctx->shm = 1;
+  } else if (!(cl_base = cl_shm_create())) return 0;
+  if (fresh) {
+    cl_init_memory(cl_base);
+    cl_md->gc_threshold = CL_GC_MIN_THRESHOLD;
+    cl_symbols = cl_md->symbols = cl_ht_new();
+    cl_global_env = cl_md->global_env = cl_ht_new();
+    cl_add_globals(cl_global_env);
+    strncpy(cl_md->build, CL_BUILD, sizeof(cl_md->build) - 1);
+    if (shared) __atomic_store_n(&cl_md->ready, 1, __ATOMIC_RELEASE);
+  } else {
+    cl_symbols = cl_md->symbols;
+    cl_global_env = cl_md->global_env;
+    cl_intern_forms();
+  }
+  if (!shared) pthread_mutex_init(&cl_md->lock, 0); // for parallel sections
+  else if (!cl_shared_join()) return 0;
+  cl_heap_advise();
+  return 1;
 }
 
 /*
  * FFI
  */
 
-typedef struct { Id (*func_ptr)(Id); } cl_cfunc_t;
+// a primitive gets its n arguments in args[0..n-1]
+// The function is kept as its distance from cl_call, which does not change
+// between processes running the same build, so cfuncs work unchanged in
+// an image or a shared heap.
+typedef struct { long func_off; } cl_cfunc_t;
+Id cl_call(Id va_f, int n, Id *args);
 
-Id cl_define_func(char *name, Id (*p)(Id), Id env) { 
-  Id va_f; CL_ALLOC(va_f, CL_TYPE_CFUNC);
+Id cl_define_func(char *name, Id (*p)(int, Id *), Id env) { 
+  Id va_f; CL_ALLOC(va_f, CL_TYPE_CFUNC, sizeof(cl_cfunc_t));
   cl_cfunc_t *cf; CL_TYPED_VA_TO_PTR0(cf, va_f, CL_TYPE_CFUNC, clNil);
-  cf->func_ptr = p;
-  cl_ht_set(env, cl_intern(S(name)), va_f);
+  cf->func_off = (char *)p - (char *)cl_call;
+  cl_ht_set(env, CP_INTERN(name), va_f);
   return clTrue;
 }
 
-Id cl_call(Id va_f, Id x) { 
+Id cl_call(Id va_f, int n, Id *args) { 
   cl_cfunc_t *cf; CL_TYPED_VA_TO_PTR(cf, va_f, CL_TYPE_CFUNC, clNil);
-  return cf->func_ptr(x);
+  return ((Id (*)(int, Id *))((char *)cl_call + cf->func_off))(n, args);
 }
 
 /*
  * Array
  */
 
-#define CL_ARY_MAX_ENTRIES ((CL_CELL_SIZE - sizeof(Id)) / sizeof(Id))
+/*
+ * An array is a window [start, size) on an array data variable, which
+ * several arrays may share: cdr is a new window one entry further in,
+ * and cons can write in front of a window.  The data variable records
+ * the range [lo, hi) that some array has claimed; an array may only
+ * extend into free room that borders its own end of the claimed range,
+ * anything else copies.
+ */
+
 typedef struct {
   int size;
   int start; 
-  Id va_entries[CL_ARY_MAX_ENTRIES];
+  Id va_entries; // array data variable
 } ht_array_t;
 
-Id cl_ary_new() {
-    Id va_ary; CL_ALLOC(va_ary, CL_TYPE_ARRAY); cl_zero(va_ary); return va_ary; }
+cl_ary_data_t *cl_ary_data(ht_array_t *a) { return VA_TO_PTR0(a->va_entries); }
+Id *cl_ary_entries(ht_array_t *a) { return cl_ary_data(a)->e; }
+int cl_ary_cap(ht_array_t *a) { 
+    return (cl_capacity(a->va_entries) - sizeof(cl_ary_data_t)) / sizeof(Id); }
+int cl_ary_push(Id va_ary, Id va);
+Id cl_ary_iterate(Id va_ary, int *i);
 
-void __ary_retain_all(ht_array_t *a) {
-    int i = 0; for (i = a->start; i < a->size; i++) cl_retain(a->va_entries[i]);}
+Id cl_ary_new() {
+    Id va_ary; CL_ALLOC(va_ary, CL_TYPE_ARRAY, sizeof(ht_array_t)); 
+    cl_zero(va_ary); return va_ary; }
+
+// moves ary's entries to a new data variable with room for `extra' more,
+// at the end or, if front is set, in front of them
+int __ary_grow(ht_array_t *ary, int extra, int front) {
+  int l = ary->size - ary->start;
+  CL_CHECK_ERROR(((size_t)l + extra >= INT_MAX / 2), "array is full", 0);
+  size_t n = 2 * (l + extra);
+  Id va_e = cl_valloc(__FUNCTION__, CL_TYPE_ARRAY_DATA, 
+      sizeof(cl_ary_data_t) + n * sizeof(Id));
+  VA_0_R(va_e, 0);
+  cl_ary_data_t *d = VA_TO_PTR0(va_e);
+  n = (cl_capacity(va_e) - sizeof(cl_ary_data_t)) / sizeof(Id);
+  d->lo = d->hi = front ? n - l : 0;
+  if (l > 0) memcpy(d->e + d->lo, cl_ary_entries(ary) + ary->start, l * sizeof(Id));
+  d->hi += l;
+  ary->va_entries = va_e;
+  ary->start = d->lo;
+  ary->size = d->hi;
+  return 1;
+}
 
-Id cl_ary_clone(Id va_s) {
+// a new array sharing the entries of va_s from index i on
+Id cl_ary_slice(Id va_s, int i) {
   ht_array_t *ary_s; CL_TYPED_VA_TO_PTR(ary_s, va_s, CL_TYPE_ARRAY, clNil);
-  Id va_c; CL_ALLOC(va_c, CL_TYPE_ARRAY);
-  char *p_c = VA_TO_PTR(va_c), *p_s = VA_TO_PTR(va_s);
-  memcpy(p_c, p_s, CL_CELL_SIZE);
-  __ary_retain_all((ht_array_t *)p_c);
-  return va_c;
+  Id va_n = cl_ary_new(); VA_0_R(va_n, clNil);
+  ht_array_t *ary = VA_TO_PTR0(va_n);
+  ary_s = VA_TO_PTR0(va_s);
+  *ary = *ary_s;
+  ary->start = ary->start + i < ary->size ? ary->start + i : ary->size;
+  return va_n;
 }
 
-int cl_ary_free(Id va_ary) {
-  ht_array_t *ary; CL_TYPED_VA_TO_PTR(ary, va_ary, CL_TYPE_ARRAY, 0);
-  int i = 0;
-  for (i = ary->start; i < ary->size; i++) cl_release(ary->va_entries[i]);
-  cl_free(va_ary);
-  return 1;
+// a new array of va followed by the entries of va_s
+Id cl_ary_cons(Id va, Id va_s) {
+  Id va_n = va_s.s ? cl_ary_slice(va_s, 0) : cl_ary_new(); VA_0_R(va_n, clNil);
+  ht_array_t *ary = VA_TO_PTR0(va_n);
+  cl_ary_data_t *d = ary->va_entries.s ? cl_ary_data(ary) : 0;
+  cl_lock(); // claims room that other threads may want too
+  if (!d || ary->start != d->lo || d->lo == 0) {
+    if (!__ary_grow(ary, 1, 1)) { cl_unlock(); return clNil; }
+    d = cl_ary_data(ary);
+  }
+  d->e[--d->lo] = va;
+  ary->start = d->lo;
+  cl_unlock();
+  return va_n;
 }
 
-Id cl_ary_new_join(Id a, Id b) {
-  ht_array_t *aa; CL_TYPED_VA_TO_PTR(aa, a, CL_TYPE_ARRAY, clNil);
-  ht_array_t *ab; CL_TYPED_VA_TO_PTR(ab, b, CL_TYPE_ARRAY, clNil);
-  Id n; CL_ALLOC(n, CL_TYPE_ARRAY);
-  ht_array_t *an; CL_TYPED_VA_TO_PTR(an, n, CL_TYPE_ARRAY, clNil);
-  int aas = aa->size - aa->start;
-  an->size = aas + ab->size - ab->start;
-  CL_CHECK_ERROR((an->size >= CL_ARY_MAX_ENTRIES), "array is full", clNil);
-  memcpy(&an->va_entries, &aa->va_entries + aa->start, aas * sizeof(Id));
-  memcpy(&an->va_entries[aas + 1], &ab->va_entries + ab->start, 
-      (ab->size - ab->start) * sizeof(Id));
-  __ary_retain_all(an);
-  return n;
+Id cl_ary_clone(Id va_s) {
+  ht_array_t *ary_s; CL_TYPED_VA_TO_PTR(ary_s, va_s, CL_TYPE_ARRAY, clNil);
+  Id va_c = cl_ary_new(), *e = cl_ary_entries(ary_s); 
+  int i = 0;
+  for (i = ary_s->start; i < ary_s->size; i++) 
+      if (!cl_ary_push(va_c, e[i])) return clNil;
+  return va_c;
 }
 
 Id cl_ary_join_by_s(Id va_ary, Id va_js) {
   ht_array_t *ary; CL_TYPED_VA_TO_PTR(ary, va_ary, CL_TYPE_ARRAY, clNil);
   CL_ACQUIRE_STR_D(djs, va_js, clNil);
-  char rs[CL_CELL_SIZE];
-  cl_string_size_t ts = 0;
+  size_t ts = 0;
+  Id *e = cl_ary_entries(ary);
   int i;
   for (i = ary->start; i < ary->size; i++) {
-    Id va_s = ary->va_entries[i];
-    CL_ACQUIRE_STR_D(ds, va_s, clNil);
-    CL_CHECK_ERROR((ts + ds.l + djs.l >= CL_CELL_SIZE),"join: array too large",clNil);
-    memcpy(rs + ts, ds.s, ds.l);
-    ts += ds.l;
-    memcpy(rs + ts, djs.s, djs.l);
-    ts += djs.l;
-  }
-  Id va_n = cl_string_new(rs, ts ? ts - djs.l : ts);
+    CL_ACQUIRE_STR_D(ds, e[i], clNil);
+    ts += ds.l + (i > ary->start ? djs.l : 0);
+  }
+  CL_CHECK_ERROR((ts >= INT_MAX), "join: string too large", clNil);
+  Id va_n; CL_ALLOC(va_n, CL_TYPE_STRING, sizeof(cl_string_size_t) + ts + 1);
+  char *p = VA_TO_PTR0(va_n);
+  *(cl_string_size_t *)p = ts;
+  p += sizeof(cl_string_size_t);
+  e = cl_ary_entries(ary);
+  for (i = ary->start; i < ary->size; i++) {
+    CL_ACQUIRE_STR_D(ds, e[i], clNil);
+    if (i > ary->start) { memcpy(p, djs.s, djs.l); p += djs.l; }
+    memcpy(p, ds.s, ds.l);
+    p += ds.l;
+  }
+  *p = 0x0;
   return va_n;
 }
 
@@ -707,15 +1315,21 @@ Id cl_ary_map(Id va_ary, Id (*func_ptr)(Id)) {
   ht_array_t *ary; CL_TYPED_VA_TO_PTR(ary, va_ary, CL_TYPE_ARRAY, clNil);
   int i;
   Id r = cl_ary_new();
-  for (i = ary->start; i < ary->size; i++) cl_ary_push(r, func_ptr(ary->va_entries[i]));
+  for (i = ary->start; i < ary->size; i++) 
+      cl_ary_push(r, func_ptr(cl_ary_entries(ary)[i]));
   return r;
 }
 
 int cl_ary_push(Id va_ary, Id va) {
   ht_array_t *ary; CL_TYPED_VA_TO_PTR(ary, va_ary, CL_TYPE_ARRAY, 0);
-  CL_CHECK_ERROR((ary->size >= CL_ARY_MAX_ENTRIES), "array is full", 0);
-  ary->size += 1;
-  ary->va_entries[ary->start + ary->size - 1] = cl_retain(va);
+  cl_lock();
+  if (!ary->va_entries.s || ary->size != cl_ary_data(ary)->hi ||
+      ary->size >= cl_ary_cap(ary)) {
+    if (!__ary_grow(ary, 1, 0)) { cl_unlock(); return 0; }
+  }
+  cl_ary_entries(ary)[ary->size++] = va;
+  cl_ary_data(ary)->hi = ary->size;
+  cl_unlock();
   return 1;
 }
 
@@ -723,7 +1337,7 @@ Id cl_ary_unshift(Id va_ary) {
   ht_array_t *ary; CL_TYPED_VA_TO_PTR(ary, va_ary, CL_TYPE_ARRAY, clNil);
   if (ary->size - ary->start <= 0) { return clNil; } 
   ary->start++;
-  return cl_release(ary->va_entries[ary->start - 1]);
+  return cl_ary_entries(ary)[ary->start - 1];
 }
 
 int cl_ary_len(Id va_ary) {
@@ -734,7 +1348,7 @@ int cl_ary_len(Id va_ary) {
 Id cl_ary_index(Id va_ary, int i) {
   ht_array_t *ary; CL_TYPED_VA_TO_PTR(ary, va_ary, CL_TYPE_ARRAY, clNil);
   if (ary->size - ary->start <= i) { return clNil; } 
-  return ary->va_entries[ary->start + i];
+  return cl_ary_entries(ary)[ary->start + i];
 }
 
 Id ca_i(Id va_ary, int i) { return cl_ary_index(va_ary, i); }
@@ -756,57 +1370,823 @@ int cl_ary_contains_only_type_i(Id a, int t) {
   return 1;
 }
 
-#define CL_PUSH_STRING { \
-    int l = ds.s + i - last_start - match_pos; \
-    if (l > 0) { \
-      Id va_ns = cl_string_new(last_start, l); VA_0_R(va_ns, clNil); \
-      if (!cl_ary_push(va_ary, va_ns)) return clNil; }}
+/*
+ * Code
+ *
+ * cl_compile turns a parsed expression into a code object; the VM in
+ * scheme-parser.c runs it on cl_vm_stack.  A lambda is a code object 
+ * closed over the frame it was created in.  Frames hold the parameters
+ * and internal defines of one call in slots that the compiler assigned;
+ * only globals live in a hash (cl_global_env).
+ */
 
-Id cl_string_split(Id va_s) {
-  Id va_ary = cl_ary_new();
-  CL_ACQUIRE_STR_D(ds, va_s, clNil);
-  if (ds.l == 0) return clNil;
-  size_t i, match_pos = 0;
-  char *last_start = ds.s;
+// The entry a CL_OP_LOAD_GLOBAL found, good while the global env is at
+// the same version.  Only adding and removing globals moves entries.
+typedef struct {
+  cl_ht_entry_t *e;
+  size_t version;
+} cl_global_cache_t;
 
-  for (i = 0; i < ds.l; i++) {
-    if (ds.s[i] != ' ') {
-      if (match_pos > 0) {
-        CL_PUSH_STRING;
-        last_start = ds.s + i;
-        match_pos = 0;
+typedef struct {
+  Id va_consts;
+  int nparams;
+  int nslots;
+  int max_stack;
+  int len;
+  int ncaches; // cl_global_caches follow the ops
+  int closures; // CL_OP_LAMBDAs in ops
+  unsigned char ops[];
+} cl_code_t;
+
+#define CL_CODE_CACHES(code) ((cl_global_cache_t *)((char *)(code) + \
+    ((sizeof(cl_code_t) + (code)->len + 7) & ~7)))
+
+typedef struct {
+  Id va_code;
+  Id va_env;
+} cl_lambda_t;
+
+typedef struct {
+  Id va_parent;
+  int size;
+  Id slots[];
+} cl_frame_t;
+
+#define CL_VM_STACK_SIZE (1024 * 1024)
+
+// Saved caller state of a lambda call; see cl_vm_run.
+typedef struct cl_vm_frame {
+  Id va_code;
+  Id frame;
+  unsigned char *ip;
+  size_t region; // cl_region_top once the call returns
+} cl_vm_frame_t;
+
+#ifndef CL_VM_MAX_DEPTH
+#define CL_VM_MAX_DEPTH 100000
+#endif
+
+/*
+ * Only a closure made while a frame is current can keep it after its 
+ * call returns, so a lambda whose code makes none gets its frame from
+ * cl_region, a stack of frames outside the heap: the VM pushes it on the
+ * call and drops it, by resetting cl_region_top, on the return or on the
+ * next tail call.  Region frames are never swept; their headers stay 
+ * marked and cl_garbage_collect marks what is in them.
+ */
+
+#define CL_REGION_SIZE (8 * 1024 * 1024)
+#define CL_REGION_FRAME_SIZE(n) ((RCS + sizeof(cl_frame_t) + (n) * sizeof(Id) + \
+    CL_GRANULE - 1) & ~(size_t)(CL_GRANULE - 1))
+
+// a frame of n slots on top of the region, or clNil when it is full
+Id cl_region_frame(int n) {
+  size_t size = CL_REGION_FRAME_SIZE(n);
+  if (!cl_region || cl_region_top + size > CL_REGION_SIZE) return clNil;
+  cl_cell_header_t *h = (cl_cell_header_t *)(cl_region + cl_region_top);
+  h->gc = CL_GC_LIVE | CL_GC_MARK;
+  h->type = CL_TYPE_FRAME;
+  h->cls = 0;
+  cl_region_top += size;
+  Id e = {(size_t)h | CL_TYPE_FRAME};
+  return e;
+}
+
+/*
+ * Garbage collection
+ *
+ * Mark & sweep, started by cl_valloc once gc_threshold bytes have been
+ * allocated since the last run.  Roots are cl_symbols, cl_global_env, the
+ * VM stack and -- conservatively -- every word on the C stack, which is
+ * where the compiler and the cfuncs keep their temporaries.
+ */
+
+size_t cl_heap_start() { 
+    return cl_md->total_size + cl_header_size() - cl_md->heap_size; }
+size_t cl_heap_end() { return cl_md->total_size + cl_header_size(); }
+
+void __gc_push(char *p) {
+  cl_cell_header_t *h = CL_HDR(p);
+  if (!h->gc || (h->gc & CL_GC_MARK)) return;
+  h->gc |= CL_GC_MARK;
+  if (cl_gc_stack_used == cl_gc_stack_size) {
+    cl_gc_stack_size = cl_gc_stack_size ? 2 * cl_gc_stack_size : 1024;
+    cl_gc_stack = realloc(cl_gc_stack, cl_gc_stack_size * sizeof(char *));
+  }
+  cl_gc_stack[cl_gc_stack_used++] = p;
+}
+
+void cl_gc_mark(Id va) { if (CL_IS_PTR(va)) __gc_push(VA_TO_PTR0(va)); }
+
+// marks the slot containing heap offset o, if there is one
+void cl_gc_mark_offset(size_t o) {
+  if (o < cl_heap_start() || o >= cl_heap_end()) return;
+  long n = o / CL_STATIC_ALLOC_SIZE, k = cl_md->segs[n];
+  if (k < 0) {
+    // inside a segment run: only its first segment has a header; the table 
+    // may be stale inside free chunks, so check the run really covers o
+    n += k; k = cl_md->segs[n];
+    if (k <= 0 || n * CL_STATIC_ALLOC_SIZE + k * CL_STATIC_ALLOC_SIZE <= o) return;
+  }
+  size_t seg = n * CL_STATIC_ALLOC_SIZE;
+  cl_cell_header_t *h = (cl_cell_header_t *)(cl_base + seg);
+  size_t cs = h->cls ? cl_class_size(h->cls) : CL_STATIC_ALLOC_SIZE;
+  __gc_push(cl_base + seg + (h->cls ? (o - seg) / cs * cs : 0) + RCS);
+}
+
+// a stack word might be an Id or a pointer into a variable; both are
+// addresses inside the variable
+void cl_gc_mark_word(size_t w) {
+  if (w >= (size_t)cl_base && w < (size_t)cl_base + CL_MEM_SIZE) 
+      cl_gc_mark_offset(w - (size_t)cl_base);
+}
+
+void __gc_mark_children(char *p) {
+  size_t i;
+  switch (CL_HDR(p)->type) {
+    case CL_TYPE_HASH: {
+      cl_hash_t *ht = (cl_hash_t *)p;
+      cl_gc_mark(ht->va_entries);
+      for (i = 0; i < ht->cap; i++) {
+        cl_ht_entry_t *s = __ht_slot(ht, i);
+        if (s->hash) { cl_gc_mark(s->va_key); cl_gc_mark(s->va_value); }
       }
-      continue;
+      break; }
+    case CL_TYPE_ARRAY: cl_gc_mark(((ht_array_t *)p)->va_entries); break;
+    case CL_TYPE_CODE: cl_gc_mark(((cl_code_t *)p)->va_consts); break;
+    case CL_TYPE_LAMBDA: 
+      cl_gc_mark(((cl_lambda_t *)p)->va_code); cl_gc_mark(((cl_lambda_t *)p)->va_env);
+      break;
+    case CL_TYPE_FRAME: {
+      cl_frame_t *f = (cl_frame_t *)p;
+      cl_gc_mark(f->va_parent);
+      for (i = 0; i < f->size; i++) cl_gc_mark(f->slots[i]);
+      break; }
+    case CL_TYPE_ARRAY_DATA: {
+      cl_ary_data_t *d = (cl_ary_data_t *)p;
+      for (i = d->lo; i < d->hi; i++) cl_gc_mark(d->e[i]);
+      break; }
+  }
+}
+
+cl_cell_header_t *__cell(size_t o) { return (cl_cell_header_t *)(cl_base + o); }
+
+// a free run from offset o of n bytes, done of them given back before; 
+// the lowest one joins the wilderness
+void __free_run(size_t o, size_t n, size_t done) {
+  size_t i, seg = o / CL_STATIC_ALLOC_SIZE, k = n / CL_STATIC_ALLOC_SIZE;
+  done = __release(cl_base + o, n, done);
+  if (o == cl_heap_start()) { cl_md->heap_size -= n; return; }
+  cl_cell_header_t *h = __cell(o);
+  h->gc = 0; h->type = 0; h->cls = 0;
+  cl_mem_chunk_descriptor_t *c = (cl_mem_chunk_descriptor_t *)((char *)h + RCS);
+  c->next = cl_md->first_free; c->size = n; c->rc_dummy = 0; c->released = done;
+  PTR_TO_VA(cl_md->first_free, c);
+  cl_md->segs[seg] = k;
+  for (i = 1; i < k; i++) cl_md->segs[seg + i] = -i;
+}
+
+// Puts the free slots of the slab segment at o into the bin of its class,
+// unless none of its cells is live; returns whether one is.
+int __rebuild_slab(size_t o, int c) {
+  size_t cs = cl_class_size(c), q;
+  int live = 0;
+  for (q = 0; q < CL_STATIC_ALLOC_SIZE; q += cs) {
+    cl_cell_header_t *h = __cell(o + q);
+    if (h->gc & CL_GC_LIVE) { h->gc = CL_GC_LIVE; live = 1; }
+  }
+  if (!live) return 0;
+  for (q = CL_STATIC_ALLOC_SIZE / cs * cs; q > 0; q -= cs) {
+    cl_cell_header_t *h = __cell(o + q - cs);
+    if (h->gc == CL_GC_LIVE) continue;
+    h->gc = 0;
+    *(Id *)((char *)h + RCS) = cl_md->bins[c];
+    PTR_TO_VA(cl_md->bins[c], (char *)h + RCS);
+    cl_md->bin_free[c]++;
+  }
+  cl_md->slots[c] += CL_STATIC_ALLOC_SIZE / cs;
+  return 1;
+}
+
+// rebuilds the bins and the free chunk list from what the cells say
+void __rebuild() {
+  size_t o, n, none = (size_t)-1, run = none, done = 0, end = cl_heap_end();
+  int c, live;
+  for (c = 1; c < CL_CLASSES; c++) { 
+      cl_md->bins[c].s = 0; cl_md->bin_free[c] = cl_md->slots[c] = 0; }
+  cl_mem_chunk_descriptor_t *w = VA_TO_PTR0(cl_header_size_ssa());
+  cl_md->first_free = cl_header_size_ssa();
+  w->next.s = 0;
+  for (o = cl_heap_start(); o < end; o += n * CL_STATIC_ALLOC_SIZE) {
+    int k = cl_md->segs[o / CL_STATIC_ALLOC_SIZE];
+    n = k > 0 ? k : 1;
+    if ((c = __cell(o)->cls)) live = __rebuild_slab(o, c);
+    else if ((live = __cell(o)->gc & CL_GC_LIVE)) __cell(o)->gc = CL_GC_LIVE;
+    else done += ((cl_mem_chunk_descriptor_t *)((char *)__cell(o) + RCS))->released;
+    if (!live && run == none) run = o;
+    if (live && run != none) { __free_run(run, o - run, done); run = none; done = 0; }
+  }
+  if (run != none) __free_run(run, end - run, done);
+  w->size = cl_heap_start() - cl_header_size();
+  cl_md->segs[cl_header_size() / CL_STATIC_ALLOC_SIZE] = w->size / CL_STATIC_ALLOC_SIZE;
+}
+
+// A variable that died is only marked free here; __rebuild then puts the
+// free slots into the bins and merges free segments into runs.
+void __gc_sweep() {
+  size_t o, n;
+  for (o = cl_heap_start(); o < cl_heap_end(); o += n * CL_STATIC_ALLOC_SIZE) {
+    char *p = cl_base + o, *q;
+    int k = cl_md->segs[o / CL_STATIC_ALLOC_SIZE];
+    n = k > 0 ? k : 1;
+    int c = ((cl_cell_header_t *)p)->cls;
+    size_t cs = c ? cl_class_size(c) : n * CL_STATIC_ALLOC_SIZE;
+    for (q = p; q < p + n * CL_STATIC_ALLOC_SIZE; q += cs) {
+      cl_cell_header_t *h = (cl_cell_header_t *)q;
+      if (h->gc & CL_GC_MARK) { h->gc = CL_GC_LIVE; continue; }
+      if (!h->gc) continue;
+      __dead(h);
+      if (!c) ((cl_mem_chunk_descriptor_t *)(q + RCS))->released = 0;
     }
-    match_pos++;
   }
-  CL_PUSH_STRING;
-  return va_ary;
+  __rebuild();
 }
 
-Id cl_input(char *prompt) {
-  if (cl_interactive) printf("%s", prompt); 
-  size_t l; 
-  char *p = fgetln(fin, &l);
-  if (l > 0 && p[0] == ';') return clNil;
-  if (l > 0 && p[l - 1] == '\n') --l;
-  Id s = cl_string_new(p, l);
-  if (cl_verbose) printf("%s\n", cl_string_ptr(s));
-  return s;
+double cl_now_ms() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+void cl_garbage_collect() {
+  double t = cl_now_ms();
+  jmp_buf regs; 
+  setjmp(regs); // spill registers onto the stack
+  size_t *w;
+  for (w = (size_t *)&regs; (void *)w < cl_gc_stack_bottom; w++) cl_gc_mark_word(*w);
+  cl_gc_mark(cl_symbols);
+  cl_gc_mark(cl_global_env);
+  int i;
+  for (i = 0; i < cl_vm_sp; i++) cl_gc_mark(cl_vm_stack[i]);
+  for (i = 0; i < cl_vm_fp; i++) {
+    cl_gc_mark(cl_vm_frames[i].va_code);
+    cl_gc_mark(cl_vm_frames[i].frame);
+  }
+  char *p;
+  for (p = cl_region; p < cl_region + cl_region_top; 
+      p += CL_REGION_FRAME_SIZE(((cl_frame_t *)(p + RCS))->size)) 
+    __gc_mark_children(p + RCS);
+  while (cl_gc_stack_used > 0) __gc_mark_children(cl_gc_stack[--cl_gc_stack_used]);
+  __gc_sweep();
+  cl_md->gc_allocated = 0;
+  cl_md->gc_threshold = cl_md->live_bytes > CL_GC_MIN_THRESHOLD ? 
+      cl_md->live_bytes : CL_GC_MIN_THRESHOLD;
+  cl_md->gc_runs++;
+  t = cl_now_ms() - t;
+  cl_md->gc_ms += t;
+  if (t > cl_md->gc_max_ms) cl_md->gc_max_ms = t;
+}
+
+// share of the carved slots of size class c that are in use
+double cl_fill_ratio(int c) {
+  return cl_md->slots[c] ? 
+      (double)(cl_md->slots[c] - cl_md->bin_free[c]) / cl_md->slots[c] : 0; }
+
+void cl_stats_dump(FILE *f) {
+  int i;
+  fprintf(f, "allocs %zu, live %zu KB, peak %zu KB, heap %zu KB, "
+      "heap peak %zu KB\n", cl_md->allocs, cl_md->live_bytes / 1024, 
+      cl_md->live_peak / 1024, cl_md->heap_size / 1024, cl_md->heap_peak / 1024);
+  fprintf(f, "gc: %zu runs, %.1f ms, longest pause %.1f ms; %zu KB released\n", 
+      cl_md->gc_runs, cl_md->gc_ms, cl_md->gc_max_ms, cl_md->released / 1024);
+  if (cl_md->compactions) fprintf(f, "%zu compactions moved %zu cells\n", 
+      cl_md->compactions, cl_md->moved);
+  fprintf(f, "%-10s %12s %12s %12s\n", "type", "allocs", "frees", "live KB");
+  for (i = 0; i <= CL_TYPE_MASK; i++) {
+    cl_type_stats_t *t = &cl_md->types[i];
+    if (t->allocs) fprintf(f, "%-10s %12zu %12zu %12zu\n", cl_type_to_cp(i), 
+        t->allocs, t->frees, t->bytes / 1024);
+  }
+  fprintf(f, "%-10s %12s %12s %12s\n", "slot size", "slots", "free", "fill");
+  for (i = 1; i < CL_CLASSES; i++) 
+    if (cl_md->slots[i]) fprintf(f, "%-10zu %12zu %12zu %11.1f%%\n", 
+        cl_class_size(i), cl_md->slots[i], cl_md->bin_free[i], 
+        100 * cl_fill_ratio(i));
+}
+
+/*
+ * Compaction (--compact)
+ *
+ * Between top-level forms nothing on the C stack or the VM stack refers
+ * into the heap, so there, after a collection, cells can move.  In each
+ * size class the live cells of the lowest slab segments fill the free
+ * slots of the highest ones (the heap grows down from its end) and leave
+ * their new Id behind.  Then every Id in the heap is redirected and the
+ * free segments are gathered into runs again; the lowest run goes back
+ * to the wilderness, which shrinks heap_size.  Large variables stay put,
+ * and so do hash keys that are hashed by their address.
+ */
+
+#define CL_GC_FWD 4 // moved; the cell's first word is its new Id
+#define CL_GC_PIN 8
+#ifndef CL_COMPACT_RATIO
+#define CL_COMPACT_RATIO 2
+#endif
+
+void __fwd(Id *va) {
+  if (!CL_IS_PTR(*va)) return;
+  char *p = VA_TO_PTR0(*va);
+  if (CL_HDR(p)->gc & CL_GC_FWD) *va = *(Id *)p;
+}
+
+void __fwd_children(char *p) {
+  size_t i;
+  switch (CL_HDR(p)->type) {
+    case CL_TYPE_HASH: {
+      cl_hash_t *ht = (cl_hash_t *)p;
+      __fwd(&ht->va_entries);
+      for (i = 0; i < ht->cap; i++) {
+        cl_ht_entry_t *s = __ht_slot(ht, i);
+        if (s->hash) { __fwd(&s->va_key); __fwd(&s->va_value); }
+      }
+      break; }
+    case CL_TYPE_ARRAY: __fwd(&((ht_array_t *)p)->va_entries); break;
+    case CL_TYPE_CODE: __fwd(&((cl_code_t *)p)->va_consts); break;
+    case CL_TYPE_LAMBDA: 
+      __fwd(&((cl_lambda_t *)p)->va_code); __fwd(&((cl_lambda_t *)p)->va_env);
+      break;
+    case CL_TYPE_FRAME: {
+      cl_frame_t *f = (cl_frame_t *)p;
+      __fwd(&f->va_parent);
+      for (i = 0; i < f->size; i++) __fwd(&f->slots[i]);
+      break; }
+    case CL_TYPE_ARRAY_DATA: {
+      cl_ary_data_t *d = (cl_ary_data_t *)p;
+      for (i = d->lo; i < d->hi; i++) __fwd(&d->e[i]);
+      break; }
+  }
+}
+
+// calls f on every cell in the heap, live or not
+void __each_cell(void (*f)(cl_cell_header_t *)) {
+  size_t o, n, q;
+  for (o = cl_heap_start(); o < cl_heap_end(); o += n * CL_STATIC_ALLOC_SIZE) {
+    int k = cl_md->segs[o / CL_STATIC_ALLOC_SIZE], c = __cell(o)->cls;
+    n = k > 0 ? k : 1;
+    size_t cs = c ? cl_class_size(c) : n * CL_STATIC_ALLOC_SIZE;
+    for (q = 0; q < n * CL_STATIC_ALLOC_SIZE; q += cs) f(__cell(o + q));
+  }
+}
+
+void __pin_keys(cl_cell_header_t *h) {
+  if (h->gc != CL_GC_LIVE || h->type != CL_TYPE_HASH) return;
+  cl_hash_t *ht = (cl_hash_t *)((char *)h + RCS);
+  int i;
+  for (i = 0; i < ht->cap; i++) {
+    Id k = __ht_slot(ht, i)->va_key;
+    if (__ht_slot(ht, i)->hash && CL_IS_PTR(k) && !cl_is_string(k)) 
+        CL_HDR(VA_TO_PTR0(k))->gc |= CL_GC_PIN;
+  }
+}
+
+void __fwd_cell(cl_cell_header_t *h) { 
+    if (h->gc & CL_GC_LIVE) __fwd_children((char *)h + RCS); }
+
+// moves the cells of size class c, whose segments are at offsets segs[0..n)
+void __compact_class(int c, size_t *segs, int n) {
+  size_t cs = cl_class_size(c), per = CL_STATIC_ALLOC_SIZE / cs, a = 0, b = 0;
+  int i = n - 1, j = 0;
+  while (i > j) {
+    if (a == per) { i--; a = 0; continue; }
+    if (b == per) { j++; b = 0; continue; }
+    cl_cell_header_t *d = __cell(segs[i] + a * cs), *s = __cell(segs[j] + b * cs);
+    if (d->gc) { a++; continue; }
+    if (s->gc != CL_GC_LIVE) { b++; continue; }
+    memcpy(d, s, cs);
+    s->gc = CL_GC_FWD;
+    ((Id *)((char *)s + RCS))->s = (size_t)d | s->type;
+    cl_md->moved++;
+  }
+}
+
+// offsets of the slab segments of size class c, lowest first
+int __class_segments(int c, size_t *segs) {
+  size_t o, n;
+  int i = 0;
+  for (o = cl_heap_start(); o < cl_heap_end(); o += n * CL_STATIC_ALLOC_SIZE) {
+    int k = cl_md->segs[o / CL_STATIC_ALLOC_SIZE];
+    n = k > 0 ? k : 1;
+    if (__cell(o)->cls == c) segs[i++] = o;
+  }
+  return i;
+}
+
+// Only call this where no Id is held outside the heap but in the roots.
+int cl_compact() {
+  if (cl_shared || cl_ctx->prof || cl_vm_fp || cl_vm_sp) return 0;
+  cl_garbage_collect();
+  size_t *segs = malloc(cl_md->heap_size / CL_STATIC_ALLOC_SIZE * sizeof(size_t));
+  P_0_R(segs, 0);
+  __each_cell(__pin_keys);
+  int c;
+  for (c = 1; c < CL_CLASSES; c++) __compact_class(c, segs, __class_segments(c, segs));
+  free(segs);
+  __each_cell(__fwd_cell);
+  __fwd(&cl_md->symbols); __fwd(&cl_md->global_env);
+  __fwd(&cl_symbols); __fwd(&cl_global_env);
+  __fwd(&cl_sym_quote); __fwd(&cl_sym_if); __fwd(&cl_sym_set); 
+  __fwd(&cl_sym_define); __fwd(&cl_sym_lambda); __fwd(&cl_sym_begin);
+  __rebuild();
+  cl_md->env_version++; // global caches point into hash entries
+  cl_md->compactions++;
+  return 1;
+}
+
+// after a collection left the heap less than 1/CL_COMPACT_RATIO used
+void cl_compact_maybe() {
+  if (cl_md->gc_runs == cl_ctx->compacted_at || 
+      CL_COMPACT_RATIO * cl_md->live_bytes > cl_md->heap_size) return;
+  cl_compact();
+  cl_ctx->compacted_at = cl_md->gc_runs;
+}
+
+/*
+ * Heap images
+ *
+ * An image is a sparse file of CL_MEM_SIZE bytes holding the memory
+ * descriptor and the used part of the heap at their offsets from cl_base.
+ * Loading maps it copy-on-write at the address it was saved from, so the
+ * symbols and globals are there without parsing or evaluating anything,
+ * and pages are read in as they are touched.
+ */
+
+int __image_write(int fd, size_t o, size_t l) {
+  ssize_t n;
+  for (; l > 0; o += n, l -= n) 
+      if ((n = pwrite(fd, (char *)cl_base + o, l, o)) <= 0) return 0;
+  return 1;
+}
+
+int cl_image_save(char *path) {
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (!cl_handle_error(fd < 0, "open", tmp).s) return 0;
+  cl_md->base = cl_base;
+  size_t hs = cl_heap_start(), he = cl_heap_end(), ss = sizeof(int), 
+      segs = offsetof(cl_mem_descriptor_t, segs);
+  int ok = !ftruncate(fd, CL_MEM_SIZE) && 
+      __image_write(fd, 0, sizeof(cl_mem_descriptor_t)) &&
+      __image_write(fd, segs + hs / CL_STATIC_ALLOC_SIZE * ss, 
+          (he - hs) / CL_STATIC_ALLOC_SIZE * ss) &&
+      // the chunk that the heap grows into
+      __image_write(fd, cl_header_size(), 
+          RCS + sizeof(cl_mem_chunk_descriptor_t)) &&
+      __image_write(fd, hs, he - hs);
+  if (close(fd)) ok = 0;
+  if (!cl_handle_error(!ok || rename(tmp, path), "save", path).s) { 
+    unlink(tmp); return 0; }
+  return 1;
+}
+
+int cl_image_load(char *path) {
+  int fd = open(path, O_RDONLY);
+  if (!cl_handle_error(fd < 0, "open", path).s) return 0;
+  cl_mem_descriptor_t md;
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size != CL_MEM_SIZE || 
+      pread(fd, &md, sizeof(md), 0) != sizeof(md) || 
+      strncmp(md.build, CL_BUILD, sizeof(md.build) - 1)) {
+    close(fd);
+    cl_handle_error_with_err_string(path, "not an image of this build", 0);
+    return 0;
+  }
+  void *base = mmap(md.base, CL_MEM_SIZE, PROT_READ | PROT_WRITE, 
+      MAP_PRIVATE | MAP_NORESERVE, fd, (off_t)0);
+  close(fd);
+  if (!cl_handle_error(base == MAP_FAILED, "mmap", path).s) return 0;
+  if (base != md.base) {
+    munmap(base, CL_MEM_SIZE);
+    cl_handle_error_with_err_string(path, "address is taken", 0);
+    return 0;
+  }
+  cl_md = cl_base = base;
+  return 1;
+}
+
+// Next line of input, with its newline; 0 at the end of the input.
+char *cl_input(char *prompt, size_t *l) {
+  if (!fin) return 0;
+  if (cl_interactive) printf("%s", prompt);
+  fflush(stdout);
+  ssize_t n = getline(&cl_ctx->line, &cl_ctx->line_cap, fin);
+  if (n < 0) return 0;
+  if (cl_verbose) printf("%.*s", (int)n, cl_ctx->line);
+  *l = n;
+  return cl_ctx->line;
 }
 
 #include "scheme-parser.c"
 
+// Runs a whole script from a mapping of it, which spares copying it line
+// by line.  Returns 0 if it cannot be mapped (a pipe, say), and then the
+// caller reads it with cl_input instead.
+int cl_batch(char *path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode)) { close(fd); return 0; }
+  if (st.st_size == 0) { close(fd); return 1; }
+  char *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, (off_t)0);
+  close(fd);
+  if (p == MAP_FAILED) return 0;
+  madvise(p, st.st_size, MADV_SEQUENTIAL);
+  FILE *f = fin;
+  fin = 0;
+  cl_repl_buffer(p, st.st_size);
+  fin = f;
+  munmap(p, st.st_size);
+  return 1;
+}
+
+/*
+ * Embedding (see clispy.h)
+ */
+
+cl_context_t *cl_context_open(char *image, char *shared, int max_depth) {
+  cl_context_t *c = calloc(1, sizeof(cl_context_t)), *prev = cl_ctx;
+  if (!c) return 0;
+  c->vm_max_depth = max_depth;
+  c->vm_stack = malloc(CL_VM_STACK_SIZE * sizeof(Id));
+  c->vm_frames = malloc(max_depth * sizeof(cl_vm_frame_t));
+  c->region = aligned_alloc(CL_GRANULE, CL_REGION_SIZE);
+  cl_ctx = c;
+  int ok = c->vm_stack && c->vm_frames && cl_init(image, shared);
+  cl_ctx = prev;
+  if (!ok) { cl_context_free(c); return 0; }
+  return c;
+}
+
+cl_context_t *cl_context_new() { return cl_context_open(0, 0, CL_VM_MAX_DEPTH); }
+
+char *cl_context_eval(cl_context_t *c, const char *src) {
+  cl_context_t *prev = cl_ctx;
+  cl_ctx = c;
+  void *bottom = cl_gc_stack_bottom;
+  FILE *f = fin;
+  if (!bottom) cl_gc_stack_bottom = __builtin_frame_address(0);
+  fin = 0;
+  cl_reader_t r = {strdup(src)};
+  r.len = r.cap = strlen(src);
+  Id x, val = clNil;
+  int eof = 0;
+  while (r.buf) { // busy with the forms until val is printed
+    x = cl_read(&r, &eof);
+    if (eof || cl_have_error()) break;
+    val = cl_eval(x);
+    if (cl_have_error()) break;
+  }
+  char *s = 0;
+  size_t l;
+  FILE *m = r.buf && !cl_have_error() ? open_memstream(&s, &l) : 0;
+  if (m) { cl_write(m, val); fclose(m); }
+  cl_shared_leave();
+  free(r.buf);
+  fin = f;
+  cl_gc_stack_bottom = bottom;
+  cl_ctx = prev;
+  return s;
+}
+
+const char *cl_context_error(cl_context_t *c) { return c->error.error_str; }
+
+void cl_context_free(cl_context_t *c) {
+  cl_context_t *prev = cl_ctx;
+  cl_ctx = c;
+  if (c->base) cl_shared_quit();
+  cl_ctx = prev == c ? 0 : prev;
+  if (c->base) munmap(c->base, CL_MEM_SIZE);
+  free(c->vm_stack);
+  free(c->vm_frames);
+  free(c->region);
+  free(c->gc_stack);
+  free(c->line);
+  free(c->cache);
+  cl_prof_free(c->prof);
+  free(c);
+}
+
+#ifndef CL_LIBRARY
+
+/*
+ * Benchmarks (--bench)
+ *
+ * Every script runs CL_BENCH_RUNS times, each in a fresh context with its
+ * output thrown away.  The fastest run is reported together with the spread,
+ * the median minus the fastest, which is how much the timings wander on
+ * this machine.  A benchmark regresses when it is slower than the baseline
+ * by more than CL_BENCH_TOLERANCE and by more than CL_BENCH_NOISE times the
+ * two spreads.  A baseline file keeps one benchmark per line so that it can
+ * be read back with sscanf.
+ */
+
+#define CL_BENCH_RUNS 9
+#define CL_BENCH_TOLERANCE 1.05 // never flag less than this times the baseline
+#define CL_BENCH_NOISE 1        // nor less than this many spreads
+#define CL_BENCH_MAX 256
+
+typedef struct {
+  char name[64];
+  double wall_ms, spread_ms, gc_ms;
+  size_t allocs, peak_kb;
+  int errors;
+} cl_bench_t;
+
+int __ms_cmp(const void *a, const void *b) { 
+  return (*(double *)a > *(double *)b) - (*(double *)a < *(double *)b); }
+
+int cl_bench_run(char *path, int max_depth, cl_bench_t *b) {
+  double ts[CL_BENCH_RUNS];
+  char *n = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+  snprintf(b->name, sizeof(b->name), "%.*s", 
+      (int)(strstr(n, ".scm") ? strstr(n, ".scm") - n : strlen(n)), n);
+  b->wall_ms = -1;
+  for (int k = 0; k < CL_BENCH_RUNS; k++) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror(path); return 0; }
+    cl_context_t *c = cl_context_open(0, 0, max_depth);
+    if (!c) { fclose(f); return 0; }
+    cl_ctx = c;
+    fin = f;
+    cl_interactive = cl_verbose = 0;
+    cl_gc_stack_bottom = __builtin_frame_address(0);
+    fflush(stdout);
+    int out = dup(1), null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    close(null);
+    double t = cl_now_ms();
+    if (!cl_batch(path)) cl_repl();
+    t = cl_now_ms() - t;
+    fflush(stdout);
+    dup2(out, 1);
+    close(out);
+    ts[k] = t;
+    if (b->wall_ms < 0 || t < b->wall_ms) {
+      b->wall_ms = t;
+      b->gc_ms = cl_md->gc_ms;
+    }
+    b->allocs = cl_md->allocs;
+    b->peak_kb = cl_md->live_peak / 1024;
+    b->errors = cl_ctx->errors;
+    cl_context_free(c);
+    fclose(f);
+  }
+  qsort(ts, CL_BENCH_RUNS, sizeof(double), __ms_cmp);
+  b->spread_ms = ts[CL_BENCH_RUNS / 2] - ts[0];
+  return 1;
+}
+
+int __bench_cmp(const void *a, const void *b) { 
+  return strcmp(*(char **)a, *(char **)b); }
+
+// benchmarks/*.scm, sorted
+int cl_bench_scan(char **files, int max) {
+  DIR *d = opendir("benchmarks");
+  if (!d) { perror("benchmarks"); return 0; }
+  struct dirent *e;
+  int n = 0;
+  while ((e = readdir(d)) && n < max) {
+    size_t l = strlen(e->d_name);
+    if (l < 5 || strcmp(e->d_name + l - 4, ".scm")) continue;
+    files[n] = malloc(l + 12);
+    sprintf(files[n++], "benchmarks/%s", e->d_name);
+  }
+  closedir(d);
+  qsort(files, n, sizeof(char *), __bench_cmp);
+  return n;
+}
+
+int cl_bench_load(char *path, cl_bench_t *bs, int max) {
+  FILE *f = fopen(path, "r");
+  if (!f) { perror(path); return -1; }
+  char line[256];
+  int n = 0;
+  while (n < max && fgets(line, sizeof(line), f)) {
+    cl_bench_t *b = &bs[n];
+    b->spread_ms = 0; // older baselines have no spread
+    if (sscanf(line, " \"%63[^\"]\": {\"wall_ms\": %lf, \"allocs\": %zu, "
+        "\"gc_ms\": %lf, \"peak_kb\": %zu, \"spread_ms\": %lf", b->name, 
+        &b->wall_ms, &b->allocs, &b->gc_ms, &b->peak_kb, &b->spread_ms) >= 5) 
+      n++;
+  }
+  fclose(f);
+  return n;
+}
+
+int cl_bench_save(char *path, cl_bench_t *bs, int n) {
+  FILE *f = fopen(path, "w");
+  if (!f) { perror(path); return 0; }
+  fprintf(f, "{\n");
+  for (int i = 0; i < n; i++)
+    fprintf(f, "  \"%s\": {\"wall_ms\": %.3f, \"allocs\": %zu, "
+        "\"gc_ms\": %.3f, \"peak_kb\": %zu, \"spread_ms\": %.3f}%s\n", 
+        bs[i].name, bs[i].wall_ms, bs[i].allocs, bs[i].gc_ms, bs[i].peak_kb, 
+        bs[i].spread_ms, i + 1 < n ? "," : "");
+  fprintf(f, "}\n");
+  return !fclose(f);
+}
+
+// Returns the exit status: 1 if a benchmark failed or got slower.
+int cl_bench(char **files, int n, char *baseline, char *save, int max_depth) {
+  static cl_bench_t bs[CL_BENCH_MAX], base[CL_BENCH_MAX];
+  int nb = 0, failed = 0, i, j;
+  if (baseline && (nb = cl_bench_load(baseline, base, CL_BENCH_MAX)) < 0) 
+      return 1;
+  if (n > CL_BENCH_MAX) n = CL_BENCH_MAX;
+  printf("%-16s %10s %8s %12s %10s %10s%s\n", "benchmark", "wall ms", 
+      "+/- ms", "allocs", "gc ms", "peak KB", baseline ? "   vs baseline" : "");
+  for (i = 0; i < n; i++) {
+    cl_bench_t *b = &bs[i], again;
+    if (!cl_bench_run(files[i], max_depth, b)) { failed = 1; continue; }
+    for (j = 0; j < nb && strcmp(base[j].name, b->name); j++);
+    // a regression has to show up twice, once may be the machine
+    int slower = 0;
+    for (int k = 0; k < 2 && j < nb && !b->errors; k++) {
+      double d = b->wall_ms - base[j].wall_ms;
+      slower = d > base[j].wall_ms * (CL_BENCH_TOLERANCE - 1) &&
+          d > CL_BENCH_NOISE * (b->spread_ms + base[j].spread_ms);
+      if (!slower || k || !cl_bench_run(files[i], max_depth, &again)) break;
+      if (again.wall_ms < b->wall_ms) *b = again;
+    }
+    printf("%-16s %10.1f %8.1f %12zu %10.1f %10zu", b->name, b->wall_ms, 
+        b->spread_ms, b->allocs, b->gc_ms, b->peak_kb);
+    if (b->errors) { printf("   %d errors", b->errors); failed = 1; }
+    else if (j < nb) {
+      printf("   %+6.1f%%%s", base[j].wall_ms > 0 ? 
+          100 * (b->wall_ms / base[j].wall_ms - 1) : 0.0, 
+          slower ? " REGRESSION" : "");
+      failed |= slower;
+    } else if (baseline) printf("   (new)");
+    printf("\n");
+  }
+  if (save && !cl_bench_save(save, bs, n)) failed = 1;
+  return failed;
+}
+
 int main(int argc, char **argv) {
-  cl_interactive = isatty(0);
-  if (argc > 1) { 
-    if ((fin = fopen(argv[argc - 1], "r")) == NULL) {
-        perror(argv[argc - 1]); exit(1); }
-    cl_interactive = 0;
-    cl_verbose = argc > 2;
-  } else { fin = stdin; }
-  cl_init();
-  cl_repl();
+  int i, nfiles = 0, verbose = 0, interactive = isatty(0);
+  int max_depth = CL_VM_MAX_DEPTH, bench = 0, stats = 0, compact = 0;
+  char *file = 0, *image = 0, *save_image = 0, *shared = 0;
+  char *baseline = 0, *save_baseline = 0, *profile = 0, *files[CL_BENCH_MAX];
+  FILE *in = stdin;
+  if (!isatty(1)) setvbuf(stdout, 0, _IOFBF, CL_OUT_BUFFER);
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-v")) verbose = 1;
+    else if (!strcmp(argv[i], "--max-depth") && i + 1 < argc) 
+        max_depth = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--image") && i + 1 < argc) image = argv[++i];
+    else if (!strcmp(argv[i], "--save-image") && i + 1 < argc) 
+        save_image = argv[++i];
+    else if (!strcmp(argv[i], "--shared") && i + 1 < argc) shared = argv[++i];
+    else if (!strcmp(argv[i], "--bench")) bench = 1;
+    else if (!strcmp(argv[i], "--stats")) stats = 1;
+    else if (!strcmp(argv[i], "--compact")) compact = 1;
+    else if (!strcmp(argv[i], "--profile") && i + 1 < argc) profile = argv[++i];
+    else if (!strcmp(argv[i], "--baseline") && i + 1 < argc) 
+        baseline = argv[++i];
+    else if (!strcmp(argv[i], "--save-baseline") && i + 1 < argc) 
+        save_baseline = argv[++i];
+    else if (nfiles < CL_BENCH_MAX) files[nfiles++] = argv[i];
+  }
+  if (max_depth < 1) { fprintf(stderr, "bad --max-depth\n"); exit(1); }
+  if (bench) {
+    if (!nfiles && !(nfiles = cl_bench_scan(files, CL_BENCH_MAX))) exit(1);
+    return cl_bench(files, nfiles, baseline, save_baseline, max_depth);
+  }
+  if (nfiles) file = files[nfiles - 1];
+  if (file) { 
+    if ((in = fopen(file, "r")) == NULL) { perror(file); exit(1); }
+    interactive = 0;
+  }
+  if (image && shared) { 
+    fprintf(stderr, "--image and --shared exclude each other\n"); exit(1); }
+  if (!(cl_ctx = cl_context_open(image, shared, max_depth))) exit(1);
+  fin = in;
+  cl_interactive = interactive;
+  cl_verbose = file ? verbose : 1;
+  cl_ctx->compact = compact;
+  cl_gc_stack_bottom = __builtin_frame_address(0);
+  if (cl_interactive) 
+      printf("clispy %s started; %zu small / %zu large vars available\n", 
+          CL_VERSION, cl_var_free(1), cl_var_free(0));
+  if (profile && !cl_prof_start()) exit(1);
+  // -v echoes the script as it is read, which is done line by line
+  if (!file || cl_verbose || !cl_batch(file)) cl_repl();
+  if (profile && !cl_prof_report(profile)) return 1;
+  if (stats) cl_stats_dump(stderr);
+  if (save_image && compact) cl_compact();
+  if (save_image && !cl_image_save(save_image)) return 1;
   return 0;
 }
 
+#endif
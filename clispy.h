@@ -0,0 +1,32 @@
+/*
+ * Embedding clispy: every context is an interpreter with its own heap,
+ * symbols and globals.  A context may be used by one thread at a time;
+ * different threads can use different contexts at once.
+ */
+
+#ifndef CLISPY_H
+#define CLISPY_H
+
+typedef struct cl_context cl_context_t;
+
+// the library is built with -fvisibility=hidden; only these are exported
+#ifndef CL_API
+#define CL_API __attribute__((visibility("default")))
+#endif
+
+// a fresh interpreter, or 0 if there is no memory for its heap
+CL_API cl_context_t *cl_context_new();
+
+// an interpreter on a saved heap image or on a named shared heap (either 
+// may be 0), allowing max_depth nested calls
+CL_API cl_context_t *cl_context_open(char *image, char *shared, int max_depth);
+
+// evaluates every expression in src and returns the last value printed 
+// into a malloc'd string, or 0 on error (see cl_context_error)
+CL_API char *cl_context_eval(cl_context_t *c, const char *src);
+
+CL_API const char *cl_context_error(cl_context_t *c);
+
+CL_API void cl_context_free(cl_context_t *c);
+
+#endif
@@ -1,2 +1,5 @@
 #! /bin/sh -v
 gcc -o clispy clispy.c
+gcc -c -fPIC -fvisibility=hidden -DCL_LIBRARY -o clispy.o clispy.c && \
+  objcopy --localize-hidden clispy.o && ar rcs libclispy.a clispy.o
+gcc -shared -fPIC -fvisibility=hidden -DCL_LIBRARY -o libclispy.so clispy.c
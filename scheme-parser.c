@@ -3,185 +3,1141 @@
  * <http://norvig.com/lispy.html>
  */
 
-Id cl_tokenize(Id va_s) {
-  if (!va_s.s) return clNil;
-  return cl_string_split(
-      cl_string_replace(cl_string_replace(va_s, S("("), S(" ( ")),
-      S(")"), S(" ) ")));
+/*
+ * Reader: cl_lex scans the input once and returns each token as a span
+ * of the buffer; cl_read_from builds the expression straight from the
+ * spans.  `;' starts a comment that runs to the end of the line.
+ */
+
+#define CL_TOK_EOF 0
+#define CL_TOK_OPEN 1
+#define CL_TOK_CLOSE 2
+#define CL_TOK_ATOM 3
+#define CL_TOK_STRING 4
+
+typedef struct {
+  char *p, *end;
+  char *s; // current token
+  size_t l;
+} cl_lexer_t;
+
+int cl_lex(cl_lexer_t *lx) {
+  char *p = lx->p;
+  while (p < lx->end) {
+    if (*p == ';') while (p < lx->end && *p != '\n') p++;
+    else if (isspace((unsigned char)*p)) p++;
+    else break;
+  }
+  lx->s = p; lx->l = 0;
+  if (p == lx->end) { lx->p = p; return CL_TOK_EOF; }
+  int t = CL_TOK_ATOM;
+  if (*p == '(' || *p == ')') { 
+    t = *p++ == '(' ? CL_TOK_OPEN : CL_TOK_CLOSE;
+  } else if (*p == '"') {
+    for (p++; p < lx->end && *p != '"'; p++) if (*p == '\\') p++;
+    // unterminated: stop in front of it, the rest may still come
+    if (p >= lx->end) { lx->p = lx->s; return CL_TOK_EOF; }
+    p++; t = CL_TOK_STRING;
+  } else {
+    while (p < lx->end && !isspace((unsigned char)*p) && *p != '(' && 
+        *p != ')' && *p != ';' && *p != '"') p++;
+  }
+  lx->l = p - lx->s; lx->p = p;
+  return t;
+}
+
+Id cl_atom(char *s, size_t l) {
+  char b[64], *ep;
+  if (l < sizeof(b)) {
+    memcpy(b, s, l); b[l] = 0;
+    long n = strtol(b, &ep, 10);
+    if (ep != b && *ep == '\0' && n >= CL_INT_MIN && n <= CL_INT_MAX) return cl_int(n);
+    double f = strtod(b, &ep);
+    if (ep != b && *ep == '\0') return cl_float(f);
+  }
+  return cl_intern_n(s, l);
+}
+
+// string literal without its quotes; escapes are undone in place
+Id __read_string(char *s, size_t l) {
+  Id va = cl_string_new(s, l); VA_0_R(va, clNil);
+  CL_ACQUIRE_STR_D(ds, va, clNil);
+  char *d = ds.s;
+  size_t i;
+  for (i = 0; i < ds.l; i++) {
+    char c = ds.s[i];
+    if (c == '\\' && i + 1 < ds.l) {
+      c = ds.s[++i];
+      if (c == 'n') c = '\n'; else if (c == 't') c = '\t';
+    }
+    *d++ = c;
+  }
+  *d = 0;
+  *(cl_string_size_t *)(ds.s - sizeof(cl_string_size_t)) = d - ds.s;
+  return va;
 }
 
-Id cl_atom(Id token) {
-  CL_ACQUIRE_STR_D(dt, token, clNil);
-  char *ep;
-  long l = strtol(dt.s, &ep, 10);
-  if (ep && *ep == '\0') return cl_int((int)l);
-  float f = strtof(dt.s, &ep);
-  if (ep && *ep == '\0') return cl_float(f);
-  return cl_intern(token);
+// Open lists are kept on an explicit stack, so nesting is only bounded by
+// the heap.  Each list goes into its parent as soon as it is opened, which
+// keeps all of them reachable from root while they are filled.
+Id cl_read_from(cl_lexer_t *lx, int t) {
+  Id root = clNil, x, *st = 0;
+  int n = 0, size = 0;
+  while (1) {
+    if (t == CL_TOK_OPEN) {
+      x = cl_ary_new();
+      if (n == size) {
+        size = size ? 2 * size : 64;
+        Id *b = realloc(st, size * sizeof(Id));
+        if (!b) { free(st); return cl_handle_error_with_err_string_nh(
+            __FUNCTION__, "out of memory"); }
+        st = b;
+      }
+      if (n) cl_ary_push(st[n - 1], x); else root = x;
+      st[n++] = x;
+    } else if (t == CL_TOK_CLOSE) {
+      if (!n) { x = cl_handle_error_with_err_string_nh(__FUNCTION__, 
+          "unexpected )"); break; }
+      if (!--n) { x = root; break; }
+    } else if (t == CL_TOK_STRING || t == CL_TOK_ATOM) {
+      x = t == CL_TOK_STRING ? __read_string(lx->s + 1, lx->l - 2) : 
+          cl_atom(lx->s, lx->l);
+      if (!n) break;
+      cl_ary_push(st[n - 1], x);
+    } else { 
+      x = cl_handle_error_with_err_string_nh(__FUNCTION__, 
+          "unexpected EOF while reading"); 
+      break; 
+    }
+    if (cl_have_error()) { x = clNil; break; }
+    t = cl_lex(lx);
+  }
+  free(st);
+  if (n > 1) CE(return clNil)
+  return x;
 }
 
-Id cl_read_from(Id tokens) {
+Id cl_parse(Id va_s) { 
+  CL_ACQUIRE_STR_D(ds, va_s, clNil);
+  cl_lexer_t lx = {ds.s, ds.s + ds.l};
   cl_reset_errors();
-  if (!tokens.s) return clNil;
-  if (cl_ary_len(tokens) == 0) 
-      return cl_handle_error_with_err_string_nh(__FUNCTION__, 
-          "unexpected EOF while reading");
-  Id token = cl_ary_unshift(tokens);
-  if (cl_string_equals_cp_i(token, "(")) {
-    Id l = cl_ary_new();
-    while (!cl_string_equals_cp_i(ca_f(tokens), ")")) {
-        cl_ary_push(l, cl_read_from(tokens)); CE(break) }
-    cl_ary_unshift(tokens);
-    return l;
-  } else if (cl_string_equals_cp_i(token, ")")) {
-    return cl_handle_error_with_err_string_nh(__FUNCTION__, 
-        "unexcpeted )");
-  } else return cl_atom(token);
-  return clNil;
+  return cl_read_from(&lx, cl_lex(&lx));
 }
 
-Id cl_parse(Id va_s) { return cl_read_from(cl_tokenize(va_s)); }
+/*
+ * The REPL collects input lines in a cl_reader_t until it holds a whole
+ * expression.  Lines are only lexed once to find that out: `scan' and
+ * `depth' carry over to the next line.
+ */
 
-Id cl_eval(Id x, Id env) {
-  if (!x.s) return clNil;
-  env = (env.s ? env : cl_global_env);
-  if (CL_TYPE(x) == CL_TYPE_SYMBOL) {
-    return cl_env_find(env, x);
-  } else if (CL_TYPE(x) != CL_TYPE_ARRAY) {
-    return x; // constant literal
-  } 
-  Id x0 = ca_f(x), exp, val= clNil, var;
-  if (cl_string_equals_cp_i(x0, "quote")) {
-    return ca_s(x);
-  } else if (cl_string_equals_cp_i(x0, "if")) { // (if test conseq alt)
-    Id test = ca_s(x), conseq = ca_th(x), alt = ca_fth(x);
-    return cnil2(cl_eval(test, env)).s ? cl_eval(conseq, env) : cl_eval(alt, env);
-  } else if (cl_string_equals_cp_i(x0, "set!")) { // (set! var exp)
-    var = ca_s(x), exp = ca_th(x);
-    cl_env_find_and_set(env, var, cl_eval(exp, env));
-  } else if (cl_string_equals_cp_i(x0, "define")) { // (define var exp)
-    var = ca_s(x), exp = ca_th(x);
-    cl_ht_set(env, var, cl_eval(exp, env));
-  } else if (cl_string_equals_cp_i(x0, "lambda")) { //(lambda (var*) exp)
-    Id l = cl_ary_new(); cl_ary_push(l, ca_s(x)); cl_ary_push(l, ca_th(x));
-    cl_ary_push(l, env);
-    return l; 
-  } else if (cl_string_equals_cp_i(x0, "begin")) {  // (begin exp*)
-    int i = 1;
-    while ((exp = cl_ary_iterate(x, &i)).s) val = cl_eval(exp, env);
-    return val;
-  } else {  // (proc exp*)
-    Id vars = cl_ary_new(), v;
-    int i = 1;
-    while ((v = cl_ary_iterate(x, &i)).s) cl_ary_push(vars, cl_eval(v, env));
-    Id lambda = cl_env_find(env, x0);
-    if (!lambda.s) { return cl_handle_error_with_err_string(__FUNCTION__, 
-            "Unknown proc", cl_string_ptr(x0)); }
-    if (cl_is_type_i(lambda, CL_TYPE_CFUNC)) return cl_call(lambda, vars);
-    Id vdecl = cl_ary_index(lambda, 0);
-    if (cl_ary_len(vdecl) != cl_ary_len(vars)) 
-        return cl_handle_error_with_err_string(__FUNCTION__, 
-            "parameter count mismatch!", cl_string_ptr(x0));
-    Id e = cl_env_new(cl_ary_index(lambda, 2)), p;
-    i = 0;
-    while ((p = cl_ary_iterate(vdecl, &i)).s)  {
-        cl_ht_set(e, p, cl_ary_index(vars, i - 1));
+typedef struct {
+  char *buf;
+  size_t len, cap;
+  size_t pos;  // start of the next expression
+  size_t scan; // lexed up to here
+  int depth;   // open lists between pos and scan
+  int lines;
+} cl_reader_t;
+
+int __complete(cl_reader_t *r) {
+  cl_lexer_t lx = {r->buf + r->scan, r->buf + r->len};
+  int t;
+  while ((t = cl_lex(&lx)) != CL_TOK_EOF) {
+    if (t == CL_TOK_OPEN) r->depth++;
+    else if (t == CL_TOK_CLOSE) r->depth--;
+    if (r->depth <= 0) { r->scan = lx.p - r->buf; r->depth = 0; return 1; }
+  }
+  r->scan = lx.p - r->buf;
+  return 0;
+}
+
+// Next expression from fin; sets *eof when the input is exhausted.
+Id cl_read(cl_reader_t *r, int *eof) {
+  size_t l;
+  char *line;
+  int more = 1;
+  cl_reset_errors();
+  while (!__complete(r)) {
+    if (!(line = cl_input(r->depth || r->scan < r->len ? 
+        "  ...> " : "clispy> ", &l))) { more = 0; break; }
+    if (r->lines++ == 0 && l > 1 && line[0] == '#' && line[1] == '!') continue;
+    if (r->pos == r->len) r->pos = r->len = r->scan = 0;
+    if (r->len + l > r->cap) {
+      r->cap = r->len + l > 2 * r->cap ? r->len + l : 2 * r->cap;
+      r->buf = realloc(r->buf, r->cap);
+    }
+    memcpy(r->buf + r->len, line, l);
+    r->len += l;
+  }
+  cl_shared_enter();
+  cl_lexer_t lx = {r->buf + r->pos, r->buf + r->len};
+  int t = cl_lex(&lx);
+  if (!more && t == CL_TOK_EOF && lx.p == lx.end) { *eof = 1; return clNil; }
+  Id x = cl_read_from(&lx, t);
+  r->pos = r->scan = more ? lx.p - r->buf : r->len;
+  r->depth = 0;
+  return x;
+}
+
+/*
+ * Compiler: special forms are resolved once, when an expression is turned
+ * into bytecode, and so are variables: a lambda's parameters and internal
+ * defines get a (depth, slot) address, everything else is global.  Every
+ * op is one byte, followed by 16 bit operands.
+ */
+
+#define CL_OP_NIL 0
+#define CL_OP_CONST 1  // k: push consts[k]
+#define CL_OP_LOAD_LOCAL 2 // d s: push slot s of the d-th enclosing frame
+#define CL_OP_SET_LOCAL 3  // d s
+#define CL_OP_LOAD_GLOBAL 4 // k c: push value of symbol consts[k]; cache c
+#define CL_OP_SET_GLOBAL 5  // k
+#define CL_OP_JUMP_IF_FALSE 6 // a
+#define CL_OP_JUMP 7   // a
+#define CL_OP_POP 8
+#define CL_OP_LAMBDA 9 // k: close code consts[k] over the frame
+#define CL_OP_CALL 10  // n k: call with n args, consts[k] names the proc
+#define CL_OP_TAILCALL 11 // n k: call that replaces the current call
+#define CL_OP_RETURN 12
+
+typedef struct cl_scope { 
+  Id va_names; // params, then internal defines
+  struct cl_scope *parent;
+} cl_scope_t;
+
+typedef struct {
+  unsigned char *ops;
+  int len, size, depth, max_depth, ncaches, closures;
+  Id va_consts;
+  cl_scope_t *scope;
+} cl_compiler_t;
+
+int __emit(cl_compiler_t *c, int op, int depth) {
+  if (c->len + 5 > c->size) {
+    c->size = c->size ? 2 * c->size : 64;
+    c->ops = realloc(c->ops, c->size);
+  }
+  c->ops[c->len++] = op;
+  c->depth += depth;
+  if (c->depth > c->max_depth) c->max_depth = c->depth;
+  return c->len;
+}
+
+int __emit_arg(cl_compiler_t *c, int a) { 
+  CL_CHECK_ERROR((a > 0xFFFF), "code too large", 0);
+  c->ops[c->len++] = a & 0xFF; c->ops[c->len++] = a >> 8; return 1; }
+
+int __patch(cl_compiler_t *c, int pos) { 
+  CL_CHECK_ERROR((c->len > 0xFFFF), "code too large", 0);
+  c->ops[pos] = c->len & 0xFF; c->ops[pos + 1] = c->len >> 8; return 1; }
+
+int __index(Id va_ary, Id va) {
+  int i = 0; Id v;
+  while ((v = cl_ary_iterate(va_ary, &i)).s) if (v.s == va.s) return i - 1;
+  return -1;
+}
+
+int __constant(cl_compiler_t *c, Id va) {
+  int i = __index(c->va_consts, va);
+  if (i >= 0) return i;
+  cl_ary_push(c->va_consts, va);
+  return cl_ary_len(c->va_consts) - 1;
+}
+
+int __emit_const(cl_compiler_t *c, int op, Id va, int depth) {
+    __emit(c, op, depth); return __emit_arg(c, __constant(c, va)); }
+
+// scopes without slots get no frame at runtime, so they are not counted
+int __emit_var(cl_compiler_t *c, int local_op, int global_op, Id sym, int depth) {
+  cl_scope_t *s;
+  int d = 0, i;
+  for (s = c->scope; s; s = s->parent) {
+    if ((i = __index(s->va_names, sym)) >= 0) {
+      __emit(c, local_op, depth); 
+      return __emit_arg(c, d) && __emit_arg(c, i);
     }
-    return cl_eval(cl_ary_index(lambda, 1), e);
+    if (cl_ary_len(s->va_names) > 0) d++;
   }
+  if (!__emit_const(c, global_op, sym, depth)) return 0;
+  return global_op == CL_OP_LOAD_GLOBAL ? __emit_arg(c, c->ncaches++) : 1;
+}
+
+// special forms (cl_sym_quote etc.) are interned by cl_intern_forms
+#define __is_form(x0, sym) ((x0).s == (sym).s)
+
+// collects the internal defines of a lambda body
+void __scan_defines(Id x, Id va_names) {
+  if (CL_TYPE(x) != CL_TYPE_ARRAY || cl_ary_len(x) == 0) return;
+  Id x0 = ca_f(x), exp;
+  if (__is_form(x0, cl_sym_quote) || __is_form(x0, cl_sym_lambda)) return;
+  if (__is_form(x0, cl_sym_define) && CL_TYPE(ca_s(x)) == CL_TYPE_SYMBOL && 
+      __index(va_names, ca_s(x)) < 0) cl_ary_push(va_names, ca_s(x));
+  int i = 0;
+  while ((exp = cl_ary_iterate(x, &i)).s) __scan_defines(exp, va_names);
+}
+
+Id cl_compile_lambda(cl_compiler_t *c, Id va_params, Id body);
+
+int cl_compile_exp(cl_compiler_t *c, Id x, int tail) {
+  if (!x.s || (CL_TYPE(x) == CL_TYPE_ARRAY && cl_ary_len(x) == 0)) 
+      return __emit(c, CL_OP_NIL, 1);
+  if (CL_TYPE(x) == CL_TYPE_SYMBOL) 
+      return __emit_var(c, CL_OP_LOAD_LOCAL, CL_OP_LOAD_GLOBAL, x, 1);
+  if (CL_TYPE(x) != CL_TYPE_ARRAY) return __emit_const(c, CL_OP_CONST, x, 1);
+  Id x0 = ca_f(x), exp;
+  int i, n;
+  if (__is_form(x0, cl_sym_quote)) {
+    exp = ca_s(x);
+    return exp.s ? __emit_const(c, CL_OP_CONST, exp, 1) : __emit(c, CL_OP_NIL, 1);
+  } else if (__is_form(x0, cl_sym_if)) { // (if test conseq alt)
+    if (!cl_compile_exp(c, ca_s(x), 0)) return 0;
+    int jf = __emit(c, CL_OP_JUMP_IF_FALSE, -1); 
+    if (!__emit_arg(c, 0) || !cl_compile_exp(c, ca_th(x), tail)) return 0;
+    int j = __emit(c, CL_OP_JUMP, -1); 
+    if (!__emit_arg(c, 0) || !__patch(c, jf)) return 0;
+    if (!cl_compile_exp(c, ca_fth(x), tail)) return 0;
+    return __patch(c, j);
+  } else if (__is_form(x0, cl_sym_set) || __is_form(x0, cl_sym_define)) { // (set! var exp)
+    CL_CHECK_TYPE(ca_s(x), CL_TYPE_SYMBOL, 0);
+    if (!cl_compile_exp(c, ca_th(x), 0)) return 0;
+    if (!__emit_var(c, CL_OP_SET_LOCAL, CL_OP_SET_GLOBAL, ca_s(x), -1)) return 0;
+    return __emit(c, CL_OP_NIL, 1);
+  } else if (__is_form(x0, cl_sym_lambda)) { //(lambda (var*) exp)
+    Id code = cl_compile_lambda(c, ca_s(x), ca_th(x)); VA_0_R(code, 0);
+    c->closures++;
+    return __emit_const(c, CL_OP_LAMBDA, code, 1);
+  } else if (__is_form(x0, cl_sym_begin)) {  // (begin exp*)
+    if (cl_ary_len(x) == 1) return __emit(c, CL_OP_NIL, 1);
+    i = 1;
+    while ((exp = cl_ary_iterate(x, &i)).s) {
+      if (i > 2) __emit(c, CL_OP_POP, -1);
+      if (!cl_compile_exp(c, exp, tail && i == cl_ary_len(x))) return 0;
+    }
+    return 1;
+  }  
+  // (proc exp*)
+  i = 0;
+  while ((exp = cl_ary_iterate(x, &i)).s) if (!cl_compile_exp(c, exp, 0)) return 0;
+  n = cl_ary_len(x) - 1;
+  __emit(c, tail ? CL_OP_TAILCALL : CL_OP_CALL, -n); 
+  return __emit_arg(c, n) && __emit_arg(c, __constant(c, x0));
+}
+
+Id __compile(cl_scope_t *scope, int nparams, Id x) {
+  cl_compiler_t c; memset(&c, 0, sizeof(c));
+  c.va_consts = cl_ary_new();
+  c.scope = scope;
+  Id va = clNil;
+  // a failed emit leaves the ops misaligned, so any error drops them
+  if (cl_compile_exp(&c, x, 1) && !cl_have_error()) {
+    __emit(&c, CL_OP_RETURN, 0);
+    size_t ops = (sizeof(cl_code_t) + c.len + 7) & ~7;
+    va = cl_valloc(__FUNCTION__, CL_TYPE_CODE, 
+        ops + c.ncaches * sizeof(cl_global_cache_t));
+  }
+  if (va.s) {
+    cl_code_t *code = VA_TO_PTR0(va);
+    code->va_consts = c.va_consts;
+    code->nparams = nparams;
+    code->nslots = scope ? cl_ary_len(scope->va_names) : 0;
+    code->max_stack = c.max_depth;
+    code->len = c.len;
+    code->ncaches = c.ncaches;
+    code->closures = c.closures;
+    memcpy(code->ops, c.ops, c.len);
+    memset(CL_CODE_CACHES(code), 0, c.ncaches * sizeof(cl_global_cache_t));
+  }
+  free(c.ops);
+  return va;
+}
+
+Id cl_compile_lambda(cl_compiler_t *c, Id va_params, Id body) {
+  cl_scope_t s = { cl_ary_new(), c->scope };
+  Id p;
+  int i = 0;
+  if (va_params.s) CL_CHECK_TYPE(va_params, CL_TYPE_ARRAY, clNil);
+  while ((p = cl_ary_iterate(va_params, &i)).s) {
+    CL_CHECK_TYPE(p, CL_TYPE_SYMBOL, clNil);
+    cl_ary_push(s.va_names, p);
+  }
+  __scan_defines(body, s.va_names);
+  return __compile(&s, i, body);
+}
+
+Id cl_compile(Id x) { return __compile(0, 0, x); }
+
+/*
+ * VM
+ *
+ * Calls to lambdas do not recurse in C: the caller's state is pushed on
+ * cl_vm_frames, and a tail call reuses the current entry, so iterative
+ * code runs in constant space.  Other recursion is limited to 
+ * cl_vm_max_depth nested calls.
+ */
+
+#define __NAME (cl_is_string(name) ? cl_string_ptr(name) : 0)
+
+// the frame for calling f; with region set it may be a region frame
+Id cl_vm_apply(Id f, int n, Id *args, Id name, int region) {
+  if (CL_TYPE(f) == CL_TYPE_CFUNC) return cl_call(f, n, args);
+  if (CL_TYPE(f) != CL_TYPE_LAMBDA) 
+      return cl_handle_error_with_err_string(__FUNCTION__, "Unknown proc", __NAME); 
+  cl_lambda_t *l = VA_TO_PTR(f); 
+  cl_code_t *code; CL_TYPED_VA_TO_PTR(code, l->va_code, CL_TYPE_CODE, clNil);
+  if (code->nparams != n) 
+      return cl_handle_error_with_err_string(__FUNCTION__, 
+          "parameter count mismatch!", __NAME);
+  if (code->nslots == 0) return l->va_env.s ? l->va_env : clTrue;
+  Id e = region && !code->closures ? cl_region_frame(code->nslots) : clNil;
+  if (!e.s) CL_ALLOC(e, CL_TYPE_FRAME, sizeof(cl_frame_t) + code->nslots * sizeof(Id));
+  cl_frame_t *fr = VA_TO_PTR0(e);
+  fr->va_parent = l->va_env;
+  fr->size = code->nslots;
+  memcpy(fr->slots, args, n * sizeof(Id));
+  memset(fr->slots + n, 0, (code->nslots - n) * sizeof(Id));
+  return e;
+}
+
+/*
+ * Profiler (--profile)
+ *
+ * With a profile attached to its context the VM keeps a shadow stack of
+ * the procedures it is in, named by the symbol they were called under,
+ * and counts calls and inclusive and exclusive time for each.  SIGPROF
+ * asks for a sample of the shadow stack, which is taken at the next call
+ * or return and kept as a folded stack line for flamegraph.pl.
+ */
+
+#define CL_PROF_HZ 1000
+#define CL_PROF_MAX_DEPTH 128 // a sample keeps the innermost frames only
+
+typedef struct { Id name; long calls; int active; double incl, excl; } cl_prof_proc_t;
+typedef struct { int proc; double t0, child; } cl_prof_entry_t;
+typedef struct { char *stack; long count; } cl_prof_sample_t;
+
+// Procedures and stacks are found by a 64 bit hash of their name, in an
+// open addressed index of entry numbers.
+typedef struct { int *index; size_t *hash; int cap, n; } cl_prof_table_t;
+
+typedef struct cl_profile {
+  cl_prof_table_t pt, st;
+  cl_prof_proc_t *procs;
+  cl_prof_sample_t *samples;
+  cl_prof_entry_t *stack;
+  int sp, stack_cap;
+  char *buf; // the sample being folded
+  size_t buf_cap;
+} cl_profile_t;
+
+volatile sig_atomic_t cl_prof_tick;
+
+void __prof_alarm(int sig) { cl_prof_tick = 1; }
+
+// where hash h is in the index, or the free slot it would take
+int __prof_slot(cl_prof_table_t *t, size_t h) {
+  size_t i = h & (t->cap - 1);
+  while (t->index[i] >= 0 && t->hash[t->index[i]] != h) i = (i + 1) & (t->cap - 1);
+  return i;
+}
+
+// the entry for h; a new one is numbered t->n, and *a grows to hold it
+int __prof_entry(cl_prof_table_t *t, size_t h, void **a, size_t size) {
+  int i = t->index[__prof_slot(t, h)];
+  if (i >= 0) return i;
+  if (2 * (t->n + 1) > t->cap) {
+    int *index = malloc(2 * t->cap * sizeof(int)), *o = t->index;
+    P_0_R(index, -1);
+    memset(index, -1, 2 * t->cap * sizeof(int));
+    t->index = index; t->cap *= 2;
+    for (i = 0; i < t->n; i++) t->index[__prof_slot(t, t->hash[i])] = i;
+    free(o);
+  }
+  size_t *hash = realloc(t->hash, (t->n + 1) * sizeof(size_t)); P_0_R(hash, -1);
+  t->hash = hash;
+  void *e = realloc(*a, (t->n + 1) * size); P_0_R(e, -1);
+  *a = e;
+  memset((char *)e + t->n * size, 0, size);
+  t->hash[t->n] = h;
+  t->index[__prof_slot(t, h)] = t->n;
+  return t->n++;
+}
+
+size_t __prof_hash(const char *s, size_t l) { 
+  size_t h = 14695981039346656037UL; 
+  while (l--) h = (h ^ (unsigned char)*s++) * 1099511628211UL; 
+  return h; 
+}
+
+char *__prof_name(cl_prof_proc_t *p) { 
+  return p->name.s ? cl_string_ptr(p->name) : "lambda"; }
+
+// folds the shadow stack, root first, into one sample line
+void __prof_sample(cl_profile_t *p) {
+  int i = p->sp > CL_PROF_MAX_DEPTH ? p->sp - CL_PROF_MAX_DEPTH : 0;
+  size_t l = 0;
+  cl_prof_tick = 0;
+  do {
+    char *n = p->sp ? __prof_name(&p->procs[p->stack[i].proc]) : "(top level)";
+    size_t nl = strlen(n);
+    if (l + nl + 2 > p->buf_cap) {
+      char *b = realloc(p->buf, p->buf_cap = 2 * (l + nl + 2));
+      if (!b) return;
+      p->buf = b;
+    }
+    if (l) p->buf[l++] = ';';
+    memcpy(p->buf + l, n, nl);
+    l += nl;
+  } while (++i < p->sp);
+  int k = __prof_entry(&p->st, __prof_hash(p->buf, l), (void **)&p->samples, 
+      sizeof(cl_prof_sample_t));
+  if (k < 0) return;
+  if (!p->samples[k].stack) p->samples[k].stack = strndup(p->buf, l);
+  p->samples[k].count++;
+}
+
+// entering a procedure called under name (a symbol, or else anonymous)
+void cl_prof_enter(cl_profile_t *p, Id name) {
+  if (CL_TYPE(name) != CL_TYPE_SYMBOL) name = clNil;
+  if (p->sp == p->stack_cap) {
+    cl_prof_entry_t *s = realloc(p->stack, 2 * p->stack_cap * sizeof(*s));
+    if (!s) return;
+    p->stack = s; p->stack_cap *= 2;
+  }
+  char *n = (char *)&name.s;
+  int i = __prof_entry(&p->pt, __prof_hash(n, sizeof(name.s)), (void **)&p->procs, 
+      sizeof(cl_prof_proc_t));
+  if (i < 0) return;
+  p->procs[i].name = name;
+  p->procs[i].calls++;
+  p->procs[i].active++;
+  cl_prof_entry_t *e = &p->stack[p->sp++];
+  e->proc = i; e->t0 = cl_now_ms(); e->child = 0;
+  if (cl_prof_tick) __prof_sample(p);
+}
+
+void cl_prof_leave(cl_profile_t *p) {
+  if (cl_prof_tick) __prof_sample(p);
+  cl_prof_entry_t *e = &p->stack[--p->sp];
+  cl_prof_proc_t *f = &p->procs[e->proc];
+  double d = cl_now_ms() - e->t0;
+  f->excl += d - e->child;
+  if (--f->active == 0) f->incl += d; // recursive calls are inside the outermost
+  if (p->sp) p->stack[p->sp - 1].child += d;
+}
+
+// attaches a profile to the current context and starts sampling
+cl_profile_t *cl_prof_start() {
+  cl_profile_t *p = calloc(1, sizeof(cl_profile_t)); P_0_R(p, 0);
+  p->pt.cap = p->st.cap = 256;
+  p->stack_cap = 1024;
+  p->pt.index = malloc(p->pt.cap * sizeof(int));
+  p->st.index = malloc(p->st.cap * sizeof(int));
+  p->stack = malloc(p->stack_cap * sizeof(cl_prof_entry_t));
+  P_0_R(p->pt.index && p->st.index && p->stack, 0);
+  memset(p->pt.index, -1, p->pt.cap * sizeof(int));
+  memset(p->st.index, -1, p->st.cap * sizeof(int));
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = __prof_alarm;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &sa, 0);
+  struct itimerval it = {{0, 1000000 / CL_PROF_HZ}, {0, 1000000 / CL_PROF_HZ}};
+  setitimer(ITIMER_PROF, &it, 0);
+  return cl_ctx->prof = p;
+}
+
+void cl_prof_free(cl_profile_t *p) {
+  if (!p) return;
+  for (int i = 0; i < p->st.n; i++) free(p->samples[i].stack);
+  free(p->pt.index); free(p->pt.hash);
+  free(p->st.index); free(p->st.hash);
+  free(p->procs);
+  free(p->samples);
+  free(p->stack);
+  free(p->buf);
+  free(p);
+}
+
+int __prof_cmp(const void *a, const void *b) {
+  double d = ((cl_prof_proc_t *)b)->excl - ((cl_prof_proc_t *)a)->excl;
+  return d > 0 ? 1 : d < 0 ? -1 : 0;
+}
+
+// stops sampling, writes the folded stacks to path and the procedures, 
+// busiest first, to stderr
+int cl_prof_report(char *path) {
+  cl_profile_t *p = cl_ctx->prof;
+  struct itimerval it;
+  memset(&it, 0, sizeof(it));
+  setitimer(ITIMER_PROF, &it, 0);
+  cl_ctx->prof = 0;
+  int i;
+  FILE *f = fopen(path, "w");
+  if (f) for (i = 0; i < p->st.n; i++) 
+      fprintf(f, "%s %ld\n", p->samples[i].stack, p->samples[i].count);
+  if (!f || fclose(f)) { perror(path); cl_prof_free(p); return 0; }
+  qsort(p->procs, p->pt.n, sizeof(cl_prof_proc_t), __prof_cmp);
+  fprintf(stderr, "%10s %10s %10s  %s\n", "calls", "incl ms", "excl ms", "procedure");
+  for (i = 0; i < p->pt.n; i++) 
+    fprintf(stderr, "%10ld %10.1f %10.1f  %s\n", p->procs[i].calls, 
+        p->procs[i].incl, p->procs[i].excl, __prof_name(&p->procs[i]));
+  cl_prof_free(p);
+  return 1;
+}
+
+#define PUSH(v) cl_vm_stack[cl_vm_sp++] = (v)
+#define POP() cl_vm_stack[--cl_vm_sp]
+#define ARG(i) (ip[2 * (i)] | ip[2 * (i) + 1] << 8)
+
+cl_frame_t *__frame(Id frame, int depth) {
+  cl_frame_t *f = VA_TO_PTR0(frame);
+  while (depth-- > 0) f = VA_TO_PTR0(f->va_parent);
+  return f;
+}
+
+#define CL_VM_ENTER \
+  code = VA_TO_PTR(va_code); ip = code->ops; \
+  ka = VA_TO_PTR(code->va_consts); \
+  k = ka->va_entries.s ? cl_ary_entries(ka) + ka->start : 0; \
+  if (cl_vm_sp + code->max_stack >= CL_VM_STACK_SIZE) { \
+    cl_handle_error_with_err_string_nh(__FUNCTION__, "stack overflow"); \
+    goto unwind; }
+
+// Other threads or processes may be changing the globals of a shared heap,
+// so there lookups go through cl_ht_get and nothing is cached.
+Id __load_global(cl_global_cache_t *gc, Id sym) {
+  cl_ht_entry_t *e;
+  if (cl_shared) return cl_ht_get(cl_global_env, sym);
+  if (!cl_ht_lookup(&e, cl_global_env, sym)) return clNil;
+  gc->e = e; gc->version = cl_md->env_version;
+  return e->va_value;
+}
+
+Id cl_vm_run(Id va_code, Id frame) {
+  int base_fp = cl_vm_fp, base_sp = cl_vm_sp;
+  size_t base_region = cl_region_top, region = base_region; // where frame starts
+  cl_profile_t *prof = cl_ctx->prof; // lambdas run here are above base_prof
+  int base_prof = prof ? prof->sp : 0;
+  cl_code_t *code; ht_array_t *ka; Id *k, v; unsigned char *ip;
+  CL_VM_ENTER;
+  while (1) {
+    switch (*ip++) {
+      case CL_OP_NIL: PUSH(clNil); break;
+      case CL_OP_CONST: PUSH(k[ARG(0)]); ip += 2; break;
+      case CL_OP_LOAD_LOCAL: PUSH(__frame(frame, ARG(0))->slots[ARG(1)]); ip += 4; break;
+      case CL_OP_SET_LOCAL: __frame(frame, ARG(0))->slots[ARG(1)] = POP(); ip += 4; break;
+      case CL_OP_LOAD_GLOBAL: {
+        cl_global_cache_t *gc = CL_CODE_CACHES(code) + ARG(1);
+        PUSH(!cl_shared && gc->version == cl_md->env_version ? 
+            gc->e->va_value : __load_global(gc, k[ARG(0)]));
+        ip += 4; break; }
+      case CL_OP_SET_GLOBAL: 
+        v = POP(); cl_ht_set(cl_global_env, k[ARG(0)], v); ip += 2; break;
+      case CL_OP_JUMP_IF_FALSE: 
+        v = POP(); ip = cnil2(v).s ? ip + 2 : code->ops + ARG(0); break;
+      case CL_OP_JUMP: ip = code->ops + ARG(0); break;
+      case CL_OP_POP: cl_vm_sp--; break;
+      case CL_OP_LAMBDA: {
+        Id va_l = cl_valloc(__FUNCTION__, CL_TYPE_LAMBDA, sizeof(cl_lambda_t)); 
+        if (!va_l.s) goto unwind;
+        cl_lambda_t *l = VA_TO_PTR0(va_l); 
+        l->va_code = k[ARG(0)]; l->va_env = frame;
+        PUSH(va_l); ip += 2; break; }
+      case CL_OP_CALL: case CL_OP_TAILCALL: {
+        int n = ARG(0), tail = ip[-1] == CL_OP_TAILCALL;
+        Id *f = &cl_vm_stack[cl_vm_sp - n - 1], fn = *f, name = k[ARG(1)];
+        if (prof && CL_TYPE(fn) != CL_TYPE_LAMBDA) cl_prof_enter(prof, name);
+        if (tail && CL_TYPE(fn) == CL_TYPE_LAMBDA) cl_region_top = region;
+        size_t top = cl_region_top;
+        v = cl_vm_apply(fn, n, f + 1, name, 1);
+        if (prof && CL_TYPE(fn) != CL_TYPE_LAMBDA) cl_prof_leave(prof);
+        cl_vm_sp -= n + 1; ip += 4;
+        if (CL_TYPE(fn) != CL_TYPE_LAMBDA || !v.s) { PUSH(v); break; }
+        if (!tail) {
+          if (cl_vm_fp >= cl_vm_max_depth) {
+            cl_handle_error_with_err_string_nh(__FUNCTION__, 
+                "maximum recursion depth exceeded");
+            goto unwind;
+          }
+          cl_vm_frame_t *r = &cl_vm_frames[cl_vm_fp++];
+          r->va_code = va_code; r->frame = frame; r->ip = ip; r->region = region;
+        }
+        region = top;
+        if (prof) {
+          if (tail && prof->sp > base_prof) cl_prof_leave(prof);
+          cl_prof_enter(prof, name);
+        }
+        cl_lambda_t *l = VA_TO_PTR0(fn);
+        va_code = l->va_code;
+        frame = CL_TYPE(v) == CL_TYPE_FRAME ? v : l->va_env;
+        CL_VM_ENTER;
+        break; }
+      case CL_OP_RETURN: {
+        v = POP();
+        if (prof && prof->sp > base_prof) cl_prof_leave(prof);
+        cl_region_top = region;
+        if (cl_vm_fp == base_fp) return v;
+        cl_vm_frame_t *r = &cl_vm_frames[--cl_vm_fp];
+        va_code = r->va_code; frame = r->frame; region = r->region;
+        CL_VM_ENTER;
+        ip = r->ip;
+        PUSH(v); break; }
+    }
+  }
+unwind:
+  cl_vm_fp = base_fp; cl_vm_sp = base_sp; cl_region_top = base_region;
+  while (prof && prof->sp > base_prof) cl_prof_leave(prof);
   return clNil;
 }
 
+Id cl_eval(Id x) {
+  if (!x.s) return clNil;
+  Id code = cl_compile(x); VA_0_R(code, clNil);
+  if (cl_have_error()) return clNil;
+  return cl_vm_run(code, clNil);
+}
+
+/*
+ * Primitives get their arguments as a slice of the VM stack.  Numbers
+ * stay ints until a float shows up, which promotes the rest of the
+ * computation; true counts as 1.
+ */
+
+#define CL_ARITY(k) CL_CHECK_ERROR((n < (k)), "too few arguments", clNil)
+#define CL_INTS(a, b) (CL_IS_INT(a) && CL_IS_INT(b))
 
-Id  __try_convert_to_floats(Id x) {
-  Id a = cl_ary_new(), n;
-  int i = 0; 
-  while ((n = cl_ary_iterate(x, &i)).s) {
-    if (!cl_is_number(n)) return clNil;
-    cl_ary_push(a, CL_TYPE(n) == CL_TYPE_INT ? cl_float(CL_INT(n)) : n);
+int __num(Id *v) { *v = cn(*v); return cl_is_number(*v); }
+double __float(Id v) { return CL_IS_INT(v) ? CL_INT(v) : CL_FLOAT(v); }
+
+// x op y for ints; cl_int turns results beyond 50 bits into doubles
+Id __int_op(char op, long x, long y) {
+  long r;
+  if (op == '*') 
+      return __builtin_mul_overflow(x, y, &r) ? cl_float((double)x * y) : cl_int(r);
+  return cl_int(op == '+' ? x + y : op == '-' ? x - y : x / y);
+}
+
+// folds the arguments left to right; (- x) and (/ x) start from 0 and 1
+Id __arith(const char *name, char op, int n, Id *args) {
+  Id a = args[0], b;
+  int i = 1;
+  if (n == 0 && (op == '+' || op == '*')) return cl_int(op == '*');
+  if (n == 0) return cl_handle_error_with_err_string_nh(name, "too few arguments");
+  if (n == 1 && (op == '-' || op == '/')) { a = cl_int(op == '/'); i = 0; }
+  if (!__num(&a)) goto nan;
+  for (; i < n; i++) {
+    b = args[i];
+    if (!__num(&b)) goto nan;
+    if (CL_INTS(a, b)) {
+      if (op == '/' && CL_INT(b) == 0) 
+          return cl_handle_error_with_err_string_nh(name, "division by zero");
+      a = __int_op(op, CL_INT(a), CL_INT(b));
+    } else {
+      double x = __float(a), y = __float(b);
+      a = cl_float(op == '+' ? x + y : op == '-' ? x - y : op == '*' ? x * y : x / y);
+    }
   }
   return a;
+nan:
+  return cl_handle_error_with_err_string_nh(name, "not a number");
 }
 
-Id  __try_convert_to_ints(Id x) {
-  Id a = cl_ary_new(), n0, n;
-  int i = 0; 
-  while ((n0 = cl_ary_iterate(x, &i)).s) {
-    n = cn(n0);
-    if (!cl_is_number(n)) return clNil;
-    cl_ary_push(a, n);
+// chained: (< a b c) holds if every neighbouring pair does
+Id __compare(const char *name, char op, int n, Id *args) {
+  int i, c;
+  if (n == 0) return cl_handle_error_with_err_string_nh(name, "too few arguments");
+  for (i = 0; i + 1 < n; i++) {
+    Id a = args[i], b = args[i + 1];
+    if (!__num(&a) || !__num(&b)) 
+        return cl_handle_error_with_err_string_nh(name, "not a number");
+    if (CL_INTS(a, b)) c = (CL_INT(a) > CL_INT(b)) - (CL_INT(a) < CL_INT(b));
+    else c = (__float(a) > __float(b)) - (__float(a) < __float(b));
+    if (!(op == '<' ? c < 0 : op == '>' ? c > 0 : op == 'l' ? c <= 0 : 
+        op == 'g' ? c >= 0 : c == 0)) return clNil;
   }
-  return a;
+  return clTrue;
+}
+
+// two fixnums never reach __arith or __compare
+#define CL_ARITH(f, op) Id f(int n, Id *args) { \
+  if (n == 2 && CL_INTS(args[0], args[1])) \
+      return __int_op(#op[0], CL_INT(args[0]), CL_INT(args[1])); \
+  return __arith(__FUNCTION__, #op[0], n, args); }
+#define CL_COMPARE(f, op, c) Id f(int n, Id *args) { \
+  if (n == 2 && CL_INTS(args[0], args[1])) \
+      return cb(CL_INT(args[0]) op CL_INT(args[1])); \
+  return __compare(__FUNCTION__, c, n, args); }
+
+void cl_write(FILE *f, Id exp);
+
+CL_ARITH(cl_add, +)
+CL_ARITH(cl_sub, -)
+CL_ARITH(cl_mul, *)
+Id cl_div(int n, Id *args) { return __arith(__FUNCTION__, '/', n, args); }
+CL_COMPARE(cl_gt, >, '>')
+CL_COMPARE(cl_lt, <, '<')
+CL_COMPARE(cl_ge, >=, 'g')
+CL_COMPARE(cl_le, <=, 'l')
+CL_COMPARE(cl_num_eq, ==, '=')
+Id cl_not(int n, Id *args) { CL_ARITY(1); return cb(!cnil2(args[0]).s); }
+Id cl_eq(int n, Id *args) { CL_ARITY(2); return cb(cl_equals_i(args[0], args[1])); }
+Id cl_length(int n, Id *args) { CL_ARITY(1); return cl_int(cl_ary_len(args[0])); }
+Id cl_cons(int n, Id *args) { 
+  CL_ARITY(2);
+  return cl_ary_cons(args[0], CL_TYPE(args[1]) == CL_TYPE_ARRAY ? args[1] : clNil);
+}
+Id cl_car(int n, Id *args) { CL_ARITY(1); return ca_f(args[0]); }
+Id cl_cdr(int n, Id *args) { CL_ARITY(1); return cl_ary_slice(args[0], 1); }
+Id cl_list(int n, Id *args) { 
+  Id l = cl_ary_new();
+  int i;
+  for (i = 0; i < n; i++) cl_ary_push(l, args[i]);
+  return l;
+}
+Id cl_is_list(int n, Id *args) { CL_ARITY(1); return cb(CL_TYPE(args[0]) == CL_TYPE_ARRAY); }
+Id cl_is_null(int n, Id *args) { CL_ARITY(1); return cb(!cnil2(args[0]).s); }
+Id cl_is_symbol(int n, Id *args) { CL_ARITY(1); return cb(CL_TYPE(args[0]) == CL_TYPE_SYMBOL); }
+Id cl_display(int n, Id *args) { 
+  int i;
+  for (i = 0; i < n; i++) { if (i) putchar(' '); cl_write(stdout, args[i]); }
+  return clNil;
+}
+Id cl_newline(int n, Id *args) { putchar('\n'); return clNil;}
+
+Id __stat(Id l, char *name, Id v) { 
+  Id e = cl_ary_new();
+  cl_ary_push(e, CP_INTERN(name)); cl_ary_push(e, v); cl_ary_push(l, e);
+  return l;
+}
+
+// ((allocs n) ... (types (string allocs frees live-bytes) ...) 
+//  (slots (size slots free fill-ratio) ...))
+Id cl_gc_stats(int n, Id *args) {
+  Id l = cl_ary_new(), types = cl_ary_new(), slots = cl_ary_new();
+  int i;
+  cl_ary_push(types, CP_INTERN("types")); cl_ary_push(slots, CP_INTERN("slots"));
+  __stat(l, "allocs", cl_int(cl_md->allocs));
+  __stat(l, "live-bytes", cl_int(cl_md->live_bytes));
+  __stat(l, "peak-bytes", cl_int(cl_md->live_peak));
+  __stat(l, "heap-bytes", cl_int(cl_md->heap_size));
+  __stat(l, "heap-peak-bytes", cl_int(cl_md->heap_peak));
+  __stat(l, "gc-runs", cl_int(cl_md->gc_runs));
+  __stat(l, "gc-ms", cl_float(cl_md->gc_ms));
+  __stat(l, "gc-max-ms", cl_float(cl_md->gc_max_ms));
+  __stat(l, "released-bytes", cl_int(cl_md->released));
+  __stat(l, "compactions", cl_int(cl_md->compactions));
+  for (i = 0; i <= CL_TYPE_MASK; i++) {
+    cl_type_stats_t *t = &cl_md->types[i];
+    if (!t->allocs) continue;
+    Id e = cl_ary_new();
+    char name[32], *p;
+    snprintf(name, sizeof(name), "%s", cl_type_to_cp(i));
+    while ((p = strchr(name, ' '))) *p = '-';
+    cl_ary_push(e, CP_INTERN(name)); cl_ary_push(e, cl_int(t->allocs));
+    cl_ary_push(e, cl_int(t->frees)); cl_ary_push(e, cl_int(t->bytes));
+    cl_ary_push(types, e);
+  }
+  for (i = 1; i < CL_CLASSES; i++) {
+    if (!cl_md->slots[i]) continue;
+    Id e = cl_ary_new();
+    cl_ary_push(e, cl_int(cl_class_size(i))); cl_ary_push(e, cl_int(cl_md->slots[i]));
+    cl_ary_push(e, cl_int(cl_md->bin_free[i])); cl_ary_push(e, cl_float(cl_fill_ratio(i)));
+    cl_ary_push(slots, e);
+  }
+  cl_ary_push(l, types); cl_ary_push(l, slots);
+  return l;
+}
+
+/*
+ * Parallel primitives
+ *
+ * (pmap f l), (pfor-each f l) and (preduce f init l) cut l into chunks for
+ * a pool of threads.  Every thread has a deque of chunks; it takes from
+ * the front of its own and, once that is empty, steals from the back of
+ * the others'.  The threads run on the caller's heap, which is locked as
+ * for a shared heap while they do (so it is not collected), and each of 
+ * them allocates from its own cache of slab slots.  preduce folds every
+ * chunk on its own and then the chunk results, so f must be associative.
+ * The pool has CLISPY_THREADS threads, by default one per CPU.
+ */
+
+#define CL_MAX_THREADS 64
+
+typedef struct { pthread_mutex_t m; int lo, hi; } cl_deque_t;
+
+typedef struct {
+  cl_context_t *owner;
+  char op; // 'm'ap, 'f'or-each or 'r'educe
+  Id f, *in, *out; // out: a result per entry, or per chunk for reduce
+  int n, chunk, nthreads;
+  cl_deque_t q[CL_MAX_THREADS];
+  int busy; // pool threads not done with the job yet
+  int failed;
+  cl_error_t error;
+} cl_job_t;
+
+pthread_mutex_t cl_pool_m = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cl_pool_go = PTHREAD_COND_INITIALIZER;
+pthread_cond_t cl_pool_done = PTHREAD_COND_INITIALIZER;
+int cl_pool_size = -1, cl_pool_busy;
+cl_job_t *cl_pool_job;
+unsigned long cl_pool_gen;
+
+// calls f from C
+Id cl_apply(Id f, int n, Id *args) {
+  Id v = cl_vm_apply(f, n, args, clNil, 0);
+  if (CL_TYPE(f) != CL_TYPE_LAMBDA || !v.s) return v;
+  cl_lambda_t *l = VA_TO_PTR0(f);
+  return cl_vm_run(l->va_code, CL_TYPE(v) == CL_TYPE_FRAME ? v : l->va_env);
+}
+
+// next chunk for thread t, or -1 when there is none left anywhere
+int __next_chunk(cl_job_t *j, int t) {
+  int i, k = -1;
+  for (i = 0; i < j->nthreads && k < 0; i++) {
+    cl_deque_t *q = &j->q[(t + i) % j->nthreads];
+    pthread_mutex_lock(&q->m);
+    if (q->lo < q->hi) k = i ? --q->hi : q->lo++;
+    pthread_mutex_unlock(&q->m);
+  }
+  return k;
+}
+
+void __run_chunk(cl_job_t *j, int k) {
+  int i = k * j->chunk, end = i + j->chunk < j->n ? i + j->chunk : j->n;
+  if (j->op == 'r') {
+    Id a[2] = {j->in[i]};
+    for (i++; i < end && !cl_have_error(); i++) { 
+      a[1] = j->in[i]; a[0] = cl_apply(j->f, 2, a); }
+    j->out[k] = a[0];
+    return;
+  }
+  for (; i < end && !cl_have_error(); i++) {
+    Id v = cl_apply(j->f, 1, &j->in[i]);
+    if (j->op == 'm') j->out[i] = v;
+  }
+}
+
+void __work(cl_job_t *j, int t) {
+  int k;
+  while (!__atomic_load_n(&j->failed, __ATOMIC_RELAXED) && 
+      (k = __next_chunk(j, t)) >= 0) {
+    __run_chunk(j, k);
+    if (!cl_have_error()) continue;
+    pthread_mutex_lock(&cl_pool_m);
+    if (!j->failed) { j->error = cl_error; j->failed = 1; }
+    pthread_mutex_unlock(&cl_pool_m);
+  }
+}
+
+void *__pool_thread(void *arg) {
+  int t = (long)arg;
+  unsigned long gen = 0;
+  cl_context_t *c = cl_ctx = calloc(1, sizeof(cl_context_t));
+  c->vm_max_depth = CL_VM_MAX_DEPTH;
+  c->vm_stack = malloc(CL_VM_STACK_SIZE * sizeof(Id));
+  c->vm_frames = malloc(c->vm_max_depth * sizeof(cl_vm_frame_t));
+  c->region = aligned_alloc(CL_GRANULE, CL_REGION_SIZE);
+  c->cache = calloc(CL_CLASSES, sizeof(Id));
+  pthread_mutex_lock(&cl_pool_m);
+  while (1) {
+    while (cl_pool_gen == gen) pthread_cond_wait(&cl_pool_go, &cl_pool_m);
+    gen = cl_pool_gen;
+    cl_job_t *j = cl_pool_job;
+    pthread_mutex_unlock(&cl_pool_m);
+    // take on the caller's heap
+    cl_context_t *o = j->owner;
+    c->base = o->base; c->md = o->md;
+    c->symbols = o->symbols; c->global_env = o->global_env;
+    c->sym_quote = o->sym_quote; c->sym_if = o->sym_if; c->sym_set = o->sym_set;
+    c->sym_define = o->sym_define; c->sym_lambda = o->sym_lambda; 
+    c->sym_begin = o->sym_begin;
+    c->shared = c->caching = 1;
+    c->shm = o->shm;
+    c->vm_sp = c->vm_fp = 0;
+    c->region_top = 0;
+    cl_reset_errors();
+    __work(j, t);
+    cl_cache_flush();
+    pthread_mutex_lock(&cl_pool_m);
+    if (--j->busy == 0) pthread_cond_signal(&cl_pool_done);
+  }
+  return 0;
 }
 
-#define ON_I \
-  int t = (cl_ary_contains_only_type_i(x, CL_TYPE_INT) ? 1 : \
-      (cl_ary_contains_only_type_i(x, CL_TYPE_FLOAT) ? 2 : 0)); \
-  if (t == 0) { \
-      Id try = __try_convert_to_ints(x);  \
-      if (try.s) { t = 1; x = try; }} \
-  if (t == 0) { \
-      Id try = __try_convert_to_floats(x);  \
-      if (try.s) { t = 2; x = try; }} \
-  int ai = CL_INT(ca_f(x)); int bi = CL_INT(ca_s(x)); \
-  float af = CL_FLOAT(ca_f(x)); float bf = CL_FLOAT(ca_s(x)); \
-  Id r = clNil; \
-  if (t == 1) { 
-#define ON_F ; } else if (t == 2) {
-#define R  ; } return r;
-
-Id cl_to_string(Id exp);
-
-Id cl_add(Id x) { ON_I r = cl_int(ai + bi) ON_F r = cl_float(af + bf) R }
-Id cl_sub(Id x) { ON_I r = cl_int(ai - bi) ON_F r = cl_float(af - bf) R }
-Id cl_mul(Id x) { ON_I r = cl_int(ai * bi) ON_F r = cl_float(af * bf) R }
-Id cl_div(Id x) { ON_I r = cl_int(ai / bi) ON_F r = cl_float(af / bf) R }
-Id cl_not(Id x) { ON_I r = cl_int(ai ^ bi) R }
-Id cl_gt(Id x) { ON_I r = cb(ai > bi) ON_F r = cb(af > bf) R }
-Id cl_lt(Id x) { ON_I r = cb(ai < bi) ON_F r = cb(af < bf) R }
-Id cl_ge(Id x) { ON_I r = cb(ai >= bi) ON_F r = cb(af >= bf) R }
-Id cl_le(Id x) { ON_I r = cb(ai <= bi) ON_F r = cb(af <= bf) R }
-Id cl_eq(Id x) { return cb(cl_equals_i(ca_f(x), ca_s(x))); }
-Id cl_length(Id x) { return cl_int(cl_ary_len(x)); }
-Id cl_cons(Id x) { return cl_ary_new_join(ca_f(x), ca_s(x)); }
-Id cl_car(Id x) { return ca_f(ca_f(x)); }
-Id cl_cdr(Id x) { Id c = cl_ary_clone(ca_f(x)); cl_ary_unshift(c); return c; }
-Id cl_list(Id x) { return x; }
-Id cl_is_list(Id x) { return cb(cl_is_type_i(x, CL_TYPE_ARRAY)); }
-Id cl_is_null(Id x) { return cb(cnil(x)); }
-Id cl_is_symbol(Id x) { return cb(cl_is_type_i(x, CL_TYPE_SYMBOL)); }
-Id cl_display(Id x) { printf("%s", cl_string_ptr(cl_ary_join_by_s(
-    cl_ary_map(x, cl_to_string), S(" ")))); return clNil;}
-Id cl_newline(Id x) { printf("\n"); return clNil;}
+// reserves the pool and returns its size, or 0 if it is in use
+int __pool_acquire() {
+  int i, n;
+  pthread_mutex_lock(&cl_pool_m);
+  if (cl_pool_size < 0) {
+    char *e = getenv("CLISPY_THREADS");
+    n = e ? atoi(e) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > CL_MAX_THREADS) n = CL_MAX_THREADS;
+    pthread_t th;
+    for (cl_pool_size = 0, i = 1; i < n; i++, cl_pool_size++) {
+      if (pthread_create(&th, 0, __pool_thread, (void *)(long)i)) break;
+      pthread_detach(th);
+    }
+  }
+  n = cl_pool_busy ? 0 : cl_pool_size;
+  if (n) cl_pool_busy = 1;
+  pthread_mutex_unlock(&cl_pool_m);
+  return n;
+}
+
+Id __parallel(char op, Id f, Id init, Id l) {
+  CL_CHECK_ERROR((l.s && CL_TYPE(l) != CL_TYPE_ARRAY), "not a list", clNil);
+  int i, n = l.s ? cl_ary_len(l) : 0;
+  if (n == 0) return op == 'r' ? init : op == 'm' ? cl_ary_new() : clNil;
+  cl_job_t *j = calloc(1, sizeof(cl_job_t));
+  P_0_R(j, clNil);
+  int pool = __pool_acquire(), nt = pool + 1;
+  j->owner = cl_ctx; j->op = op; j->f = f; j->n = n; j->nthreads = nt;
+  j->in = cl_ary_entries(VA_TO_PTR0(l)) + ((ht_array_t *)VA_TO_PTR0(l))->start;
+  j->chunk = n / (nt * 8) > 0 ? n / (nt * 8) : 1;
+  int nchunks = (n + j->chunk - 1) / j->chunk;
+  Id va_out = cl_ary_new();
+  for (i = 0; i < (op == 'r' ? nchunks : n); i++) cl_ary_push(va_out, clNil);
+  j->out = cl_ary_entries(VA_TO_PTR0(va_out));
+  for (i = 0; i < nt; i++) {
+    pthread_mutex_init(&j->q[i].m, 0);
+    j->q[i].lo = nchunks * i / nt; j->q[i].hi = nchunks * (i + 1) / nt;
+  }
+  int shared = cl_shared, caching = cl_ctx->caching;
+  if (!cl_ctx->cache) cl_ctx->cache = calloc(CL_CLASSES, sizeof(Id));
+  cl_shared = cl_ctx->caching = 1;
+  if (pool) {
+    pthread_mutex_lock(&cl_pool_m);
+    j->busy = pool; cl_pool_job = j; cl_pool_gen++;
+    pthread_cond_broadcast(&cl_pool_go);
+    pthread_mutex_unlock(&cl_pool_m);
+  }
+  __work(j, 0);
+  if (pool) {
+    pthread_mutex_lock(&cl_pool_m);
+    while (j->busy) pthread_cond_wait(&cl_pool_done, &cl_pool_m);
+    cl_pool_busy = 0;
+    pthread_mutex_unlock(&cl_pool_m);
+  }
+  if (!caching) { cl_cache_flush(); cl_ctx->caching = 0; }
+  cl_shared = shared;
+  Id r = op == 'm' ? va_out : clNil;
+  if (j->failed && !cl_have_error()) cl_error = j->error;
+  if (op == 'r' && !j->failed) {
+    Id a[2] = {init};
+    // f may collect, so the partial results are read through va_out, 
+    // which keeps them reachable from the C stack
+    for (i = 0; i < nchunks && !cl_have_error(); i++) { 
+      a[1] = cl_ary_index(va_out, i); a[0] = cl_apply(f, 2, a); }
+    r = a[0];
+  }
+  free(j);
+  return cl_have_error() ? clNil : r;
+}
+
+Id cl_pmap(int n, Id *args) { 
+    CL_ARITY(2); return __parallel('m', args[0], clNil, args[1]); }
+Id cl_pfor_each(int n, Id *args) { 
+    CL_ARITY(2); return __parallel('f', args[0], clNil, args[1]); }
+Id cl_preduce(int n, Id *args) { 
+    CL_ARITY(3); return __parallel('r', args[0], args[1], args[2]); }
 
 char *cl_std_n[] = {"+", "-", "*", "/", "not", ">", "<", ">=", "<=", "=",
     "equal?", "eq?", "length", "cons", "car", "cdr", "list", "list?", 
-    "null?", "symbol?", "display", "newline", 0};
-Id (*cl_std_f[])(Id) = {cl_add, cl_sub, cl_mul, cl_div, cl_not, cl_gt, cl_lt, cl_ge, 
-    cl_le, cl_eq, cl_eq, cl_eq, cl_length, cl_cons, cl_car, cl_cdr,
-    cl_list, cl_is_list, cl_is_null, cl_is_symbol, cl_display,
-    cl_newline, 0};
+    "null?", "symbol?", "display", "newline", "pmap", "pfor-each", "preduce", 
+    "gc-stats", 0};
+Id (*cl_std_f[])(int, Id *) = {cl_add, cl_sub, cl_mul, cl_div, cl_not, cl_gt, 
+    cl_lt, cl_ge, cl_le, cl_num_eq, cl_eq, cl_eq, cl_length, cl_cons, cl_car, 
+    cl_cdr, cl_list, cl_is_list, cl_is_null, cl_is_symbol, cl_display,
+    cl_newline, cl_pmap, cl_pfor_each, cl_preduce, cl_gc_stats, 0};
+
+void cl_intern_forms() {
+  cl_sym_quote = CP_INTERN("quote"); cl_sym_if = CP_INTERN("if");
+  cl_sym_set = CP_INTERN("set!"); cl_sym_define = CP_INTERN("define");
+  cl_sym_lambda = CP_INTERN("lambda"); cl_sym_begin = CP_INTERN("begin");
+}
 
 void cl_add_globals(Id env) {
   int i = 0;
+  cl_intern_forms();
   while (cl_std_n[i] != 0) { cl_define_func(cl_std_n[i], cl_std_f[i], env); i++; }
 }
 
-Id cl_to_string(Id exp) {
-  if (CL_TYPE(exp) == CL_TYPE_BOOL) { return S(exp.s ? "true" : "null"); }
-  if (cl_is_number(exp)) return cl_string_new_number(exp);
-  if (CL_TYPE(exp) == CL_TYPE_CFUNC) return S("CFUNC");
-  if (CL_TYPE(exp) != CL_TYPE_ARRAY) return exp;
-  Id s = S("(");
-  cl_string_append(s, cl_ary_join_by_s(cl_ary_map(exp, cl_to_string), S(" ")));
-  return cl_string_append(s, S(")"));
+/*
+ * Printer: values are written element by element into a stdio stream,
+ * whose buffer is the output port, so printing costs O(output) and
+ * allocates nothing on the heap.  main makes stdout fully buffered in
+ * CL_OUT_BUFFER bytes unless it is a terminal; cl_input flushes it before
+ * waiting for input, and errors go through the same buffer.
+ */
+
+#define CL_OUT_BUFFER 65536
+
+// nested lists are kept on an explicit stack, not the C stack
+typedef struct { ht_array_t *ary; int i; } cl_write_frame_t;
+
+void __print(FILE *f, Id exp) {
+  cl_write_frame_t *st = 0;
+  int n = 0, size = 0;
+  while (1) {
+    int t = CL_TYPE(exp);
+    if (t == CL_TYPE_BOOL) fputs(exp.s ? "true" : "null", f);
+    else if (t == CL_TYPE_INT) fprintf(f, "%ld", CL_INT(exp));
+    else if (t == CL_TYPE_FLOAT) fprintf(f, "%f", CL_FLOAT(exp));
+    else if (t == CL_TYPE_CFUNC) fputs("CFUNC", f);
+    else if (t == CL_TYPE_LAMBDA) fputs("LAMBDA", f);
+    else if (t == CL_TYPE_ARRAY) {
+      ht_array_t *ary = VA_TO_PTR(exp);
+      putc_unlocked('(', f);
+      if (n == size) {
+        size = size ? 2 * size : 64;
+        st = realloc(st, size * sizeof(cl_write_frame_t));
+      }
+      st[n].ary = ary;
+      st[n++].i = ary->start;
+    } else {
+      cl_str_d ds;
+      if (cl_acquire_string_data(exp, &ds)) fwrite(ds.s, 1, ds.l, f);
+    }
+    while (n > 0 && st[n - 1].i >= st[n - 1].ary->size) {
+      putc_unlocked(')', f);
+      n--;
+    }
+    if (!n) break;
+    cl_write_frame_t *w = &st[n - 1];
+    if (w->i > w->ary->start) putc_unlocked(' ', f);
+    exp = cl_ary_entries(w->ary)[w->i++];
+  }
+  free(st);
 }
 
-void cl_repl() {
+// the whole value goes out together, also with other threads writing
+void cl_write(FILE *f, Id exp) { flockfile(f); __print(f, exp); funlockfile(f); }
+
+void __repl(cl_reader_t *r) {
+  int eof = 0;
   while (1) {
-    Id val = cl_eval(cl_parse(cl_input("clispy> ")), cl_global_env);
-    if (feof(fin)) return;
-    if (cl_interactive) printf("-> %s\n", cl_string_ptr(cl_to_string(val)));
-    cl_garbage_collect();
+    Id x = cl_read(r, &eof);
+    if (eof) { cl_shared_leave(); break; }
+    Id val = cl_eval(x);
+    if (cl_interactive) { printf("-> "); cl_write(stdout, val); putchar('\n'); }
+    if (cl_ctx->compact) cl_compact_maybe();
+    cl_shared_leave();
+  }
+}
+
+void cl_repl() {
+  cl_reader_t r = {0};
+  __repl(&r);
+  free(r.buf);
+}
+
+// Evaluates all of buf, which is not written to; fin must be 0.
+void cl_repl_buffer(char *buf, size_t len) {
+  cl_reader_t r = {buf, len, len};
+  if (len > 1 && buf[0] == '#' && buf[1] == '!') {
+    char *nl = memchr(buf, '\n', len);
+    r.pos = r.scan = nl ? nl - buf + 1 : len;
   }
+  __repl(&r);
 }
@@ -0,0 +1,13 @@
+#! ./clispy
+(display (+ 1 2 3 4) (- 10 1 2) (* 2 3 4) (/ 20 2 5))
+(newline)
+(display (+) (*) (- 5) (+ 1 2.5) (* 2 0.5 4))
+(newline)
+(display (< 1 2 3) (< 1 3 2) (>= 3 3 1) (= 2 2.0) (> 2.5 2))
+(newline)
+(display (+ 1 (= 1 1)) (not (< 2 1)))
+(newline)
+(display (cons 1 (list 2 3)) (car (list 4 5)) (cdr (list 4 5)) (null? (cdr (list 1))))
+(newline)
+(/ 1 0)
+(+ 1 (quote a))
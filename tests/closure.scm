@@ -0,0 +1,14 @@
+#! ./clispy
+(define adder (lambda (a) (lambda (b) (lambda (c) (+ a (+ b c))))))
+(display (((adder 1) 2) 3))
+(newline)
+(define f (lambda (x) (begin (define y (* x 2)) (define g (lambda (z) (+ y z))) (g x))))
+(display (f 5))
+(newline)
+(define counter (lambda () (begin (define n 0) (lambda () (begin (set! n (+ n 1)) n)))))
+(define c1 (counter))
+(c1)
+(display (c1))
+(newline)
+(display ((lambda () 7)))
+(newline)
@@ -0,0 +1,20 @@
+#! /bin/sh
+# Code objects address their ops and arguments with 16 bits; forms that
+# need more are refused with "code too large" and nothing of them runs.
+CLISPY=${CLISPY:-./clispy}
+f=${TMPDIR:-/tmp}/code-size.$$.scm
+trap 'rm -f $f' EXIT
+
+# an if whose branch is over 64KB of code
+{ printf '(display (if 1 (begin'
+  i=0; while [ $i -lt 12000 ]; do printf ' car'; i=$((i + 1)); done
+  printf ') 2))\n(display 3)\n(newline)\n'
+} > $f
+$CLISPY $f
+
+# a call with 70000 arguments
+{ printf '(display (list'
+  i=0; while [ $i -lt 70000 ]; do printf ' 1'; i=$((i + 1)); done
+  printf '))\n(display 4)\n(newline)\n'
+} > $f
+$CLISPY $f
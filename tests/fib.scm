@@ -0,0 +1,4 @@
+#! ./clispy
+(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+(begin (display (fib 20)) (newline))
+(begin (display ((lambda (x y) (* x y)) 6 7)) (newline))
@@ -0,0 +1,20 @@
+#! ./clispy
+; lambdas that make no closures get their frames from the region
+(define build (lambda (n acc) (if (= n 0) acc (build (- n 1) (cons n acc)))))
+(define keep (lambda (l n) (begin (define copy (build n (quote ()))) (list (length l) (length copy) (car l)))))
+(define nest (lambda (n) (if (= n 0) (keep (build 500 (quote ())) 300) (car (list (nest (- n 1)))))))
+(display (nest 200))
+(newline)
+; a closure over a heap frame, called from region frames
+(define adder (lambda (k) (lambda (x) (+ x k))))
+(define add5 (adder 5))
+(define sum (lambda (l acc) (if (null? l) acc (sum (cdr l) (add5 (+ acc (car l)))))))
+(display (sum (build 1000 (quote ())) 0))
+(newline)
+(display (pmap (lambda (x) (length (build x (quote ())))) (list 10 20 30)))
+(newline)
+; an error deep in a recursion drops its frames
+(define bad (lambda (n) (if (= n 0) (keep 1) (+ 1 (bad (- n 1))))))
+(bad 50)
+(display (nest 3))
+(newline)
@@ -0,0 +1,28 @@
+#! ./clispy
+(define f (lambda (x) (+ x 1)))
+(define call-f (lambda (x) (f x)))
+(display (call-f 1))
+(newline)
+(define f (lambda (x) (* x 10)))
+(display (call-f 2))
+(newline)
+(define g 5)
+(define get-g (lambda () g))
+(display (get-g))
+(set! g 6)
+(display (get-g))
+(newline)
+(define deep (lambda (a) (lambda (b) (lambda (c) (+ g (+ a (+ b c)))))))
+(define d (((deep 1) 2) 3))
+(display d)
+(newline)
+(define a1 1) (define a2 2) (define a3 3) (define a4 4) (define a5 5) (define a6 6)
+(define a7 7) (define a8 8) (define a9 9) (define a10 10) (define a11 11) (define a12 12)
+(define a13 13) (define a14 14) (define a15 15) (define a16 16) (define a17 17)
+(display (get-g) (call-f 3) (+ a1 a17))
+(newline)
+(define later (lambda () not-yet))
+(display (later))
+(define not-yet 42)
+(display (later))
+(newline)
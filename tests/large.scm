@@ -0,0 +1,12 @@
+#! ./clispy
+(define range (lambda (n acc) (if (= n 0) acc (range (- n 1) (cons n acc)))))
+(define big (range 200000 (list)))
+(display (length big)) (newline)
+(display (car big)) (newline)
+(define sum (lambda (l acc) (if (null? l) acc (sum (cdr l) (+ acc (car l))))))
+(display (sum big 0)) (newline)
+(define last (lambda (l) (if (null? (cdr l)) (car l) (last (cdr l)))))
+(display (last big)) (newline)
+(define big2 (cons 0 big))
+(display (length big2)) (newline)
+(display (length big)) (newline)
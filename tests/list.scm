@@ -0,0 +1,14 @@
+#! ./clispy
+(define build (lambda (n l) (if (= n 0) l (build (- n 1) (cons n l)))))
+(define sum (lambda (l acc) (if (null? l) acc (sum (cdr l) (+ acc (car l))))))
+(define big (build 5000 (list)))
+(display (length big) (sum big 0))
+(newline)
+(define a (list 1 2 3))
+(define b (cons 0 a))
+(define c (cons 9 a))
+(display a b c (cdr b) (cdr (cdr (cdr (cdr a)))))
+(newline)
+(define l (cdr a))
+(display (cons 7 l) a)
+(newline)
@@ -0,0 +1,7 @@
+#! ./clispy
+(display (* 1000000 1000000) (- 0 562949953421311 1) (+ 562949953421311 1))
+(newline)
+(display (* 4611686018427387904 4) (/ 1 3.0) (< 562949953421311 562949953421312.5))
+(newline)
+(display (= 0.1 0.1) (= (+ 0.5 0.25) 0.75) (- 7) (/ 7 2))
+(newline)
@@ -0,0 +1,21 @@
+#! ./clispy
+(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+(display (pmap fib (list 1 2 3 4 5 6 7 8 9 10 20)))
+(newline)
+(define range (lambda (n acc) (if (= n 0) acc (range (- n 1) (cons n acc)))))
+(define big (range 10000 (list)))
+(display (preduce + 0 (pmap (lambda (x) (* x x)) big)))
+(newline)
+(display (preduce + 100 (list)) (pmap car (list)))
+(newline)
+(display (pmap (lambda (x) (cons x (list x))) (list 1 2 3)))
+(newline)
+(display (pfor-each (lambda (x) (* x x)) big))
+(newline)
+(define nested (lambda (l) (preduce + 0 (pmap (lambda (x) (* 2 x)) l))))
+(display (pmap nested (list (list 1 2) (list 3 4) (list 5))))
+(newline)
+; the fold allocates, so collections run while the partial results wait
+(define add (lambda (a b) (car (list (+ a b) (range 200 (list))))))
+(display (preduce add 0 (range 4000 (list))))
+(newline)
@@ -0,0 +1,14 @@
+#! /bin/sh
+# The printer walks nested lists with its own stack, so depth is only
+# bounded by the heap: a list nested a million deep prints in full.
+CLISPY=${CLISPY:-./clispy}
+f=${TMPDIR:-/tmp}/print-deep.$$.scm
+trap 'rm -f $f' EXIT
+
+cat > $f <<'SCM'
+(define nest (lambda (n acc) (if (= n 0) acc (nest (- n 1) (list acc)))))
+(display (nest 1000000 7))
+(newline)
+SCM
+$CLISPY $f | wc -c | tr -d ' '
+$CLISPY $f | cut -c 999995-1000010
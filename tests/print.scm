@@ -0,0 +1,10 @@
+#! ./clispy
+(display (list 1 (quote ()) -2 (quote (a (b (c)) "s")) 1.5 car (lambda (x) x) (= 1 1) (= 1 2)))
+(newline)
+(display "two" "args" 3)
+(newline)
+(define build (lambda (n acc) (if (= n 0) acc (build (- n 1) (cons (list n (list n)) acc)))))
+(display (build 20000 (quote ())))
+(newline)
+(display (cdr (cdr (list 1 2 3))))
+(newline)
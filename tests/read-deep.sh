@@ -0,0 +1,19 @@
+#! /bin/sh
+# The reader keeps open lists on its own stack: a form nested a million
+# deep is read, and one left open is an error rather than a crash.
+CLISPY=${CLISPY:-./clispy}
+f=${TMPDIR:-/tmp}/read-deep.$$.scm
+trap 'rm -f $f' EXIT
+
+awk 'BEGIN {
+  printf "(define d (quote "
+  for (i = 0; i < 1000000; i++) printf "(x "
+  for (i = 0; i < 1000000; i++) printf ")"
+  print "))"
+  print "(define depth (lambda (l n) (if (null? (cdr l)) n (depth (car (cdr l)) (+ n 1)))))"
+  print "(display (depth d 1))"
+  print "(newline)"
+  for (i = 0; i < 100000; i++) printf "(list "
+  print ""
+}' > $f
+$CLISPY $f
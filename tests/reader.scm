@@ -0,0 +1,12 @@
+#! ./clispy
+; comments and forms that span lines
+(define sum3 (lambda (a b c) ; trailing comment
+  (+ a
+     (+ b c))))
+(display (sum3 1 2 3)) (newline)
+(display "a string (with parens) ; and no comment")
+(newline)
+(display "two
+lines\tand \"quotes\"")
+(newline)
+(display (quote (1 2.5 x))) (newline)
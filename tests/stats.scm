@@ -0,0 +1,15 @@
+#! ./clispy
+(define s (gc-stats))
+(define names (lambda (l) (if (null? l) (list) (cons (car (car l)) (names (cdr l))))))
+(display (names s))
+(newline)
+(define find (lambda (k l) (if (null? l) (list) (if (eq? k (car (car l))) (car l) (find k (cdr l))))))
+(define live (car (cdr (find (quote live-bytes) s))))
+(display (> live 0) (>= (car (cdr (find (quote peak-bytes) s))) live))
+(newline)
+(define heap (lambda () (car (cdr (find (quote heap-bytes) (gc-stats))))))
+(define heap-peak (lambda () (car (cdr (find (quote heap-peak-bytes) (gc-stats))))))
+(display (>= (heap-peak) (heap)))
+(newline)
+(display (car (find (quote hash-data) (cdr (find (quote types) s)))))
+(newline)
@@ -0,0 +1,5 @@
+#! ./clispy
+(display (eq? (quote abc) (quote abc)))
+(newline)
+(display (eq? (quote abc) (quote abd)))
+(newline)
@@ -0,0 +1,14 @@
+#! ./clispy
+(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (+ acc 1)))))
+(display (loop 200000 0))
+(newline)
+(define even? (lambda (n) (if (= n 0) 1 (odd? (- n 1)))))
+(define odd? (lambda (n) (if (= n 0) 0 (even? (- n 1)))))
+(display (even? 100001))
+(newline)
+(define down (lambda (n) (if (= n 0) 0 (+ 1 (down (- n 1))))))
+(display (down 5000))
+(newline)
+(down 1000000)
+(display (down 10))
+(newline)